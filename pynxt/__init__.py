@@ -1,6 +1,6 @@
-from ._nxt import NXT
+from ._nxt import NXT, NXTTimeout
 
 
 __version__ = '0.1.0'
 
-__all__ = ['NXT']
+__all__ = ['NXT', 'NXTTimeout']
@@ -1,6 +1,23 @@
 #include <Python.h>
 #include <structmember.h>
 
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
 #include "nxt.h"
 
 #define COMPILING_IN_PY2 (PY_VERSION_HEX <= 0x03000000)
@@ -8,6 +25,265 @@
 #define PyLong_FromLong PyInt_FromLong
 #endif /* COMPILING_IN_PY2 */
 
+/* Telegram types from the NXT Bluetooth developer kit. */
+#define DIRECT_COMMAND 0x00
+#define REPLY 0x02
+#define DIRECT_COMMAND_NOREPLY 0x80
+#define SYSTEM_COMMAND 0x01
+
+/* Direct command opcodes from the NXT Bluetooth developer kit. C_NXT only
+   opens and closes the connection; every command is encoded here. */
+#define OP_PLAYTONE 0x03
+#define OP_SETOUTPUTSTATE 0x04
+#define OP_SETINPUTMODE 0x05
+#define OP_GETOUTPUTSTATE 0x06
+#define OP_GETINPUTVALUES 0x07
+#define OP_MESSAGEWRITE 0x09
+#define OP_GETBATTERYLEVEL 0x0b
+#define OP_KEEPALIVE 0x0d
+#define OP_MESSAGEREAD 0x13
+
+/* System command opcodes for the NXT's flash file system. */
+#define OP_OPENREAD 0x80
+#define OP_OPENWRITE 0x81
+#define OP_READ 0x82
+#define OP_WRITE 0x83
+#define OP_CLOSE 0x84
+#define OP_DELETE 0x85
+#define OP_OPENWRITELINEAR 0x89
+
+/* The size of each telegram in bytes, not counting the 2 byte Bluetooth
+   length prefix. */
+#define LEN_PLAYTONE 6
+#define LEN_SETOUTPUTSTATE 13
+#define LEN_SETINPUTMODE 5
+#define LEN_GETOUTPUTSTATE 3
+#define LEN_GETINPUTVALUES 3
+#define LEN_GETBATTERYLEVEL 2
+#define LEN_KEEPALIVE 2
+#define LEN_MESSAGEREAD 5
+
+/* The size of a MESSAGEWRITE telegram before the message itself. */
+#define LEN_MESSAGEWRITE_HEADER 4
+
+/* File names are sent as a null padded 20 byte field, so they may be at most
+   19 bytes long. The NXT expects a 15.3 name. */
+#define LEN_FILENAME 20
+#define MAX_FILENAME 19
+
+#define LEN_OPENREAD (2 + LEN_FILENAME)
+#define LEN_OPENWRITE (2 + LEN_FILENAME + 4)
+#define LEN_READ 5
+#define LEN_CLOSE 3
+#define LEN_DELETE (2 + LEN_FILENAME)
+
+/* The size of a WRITE telegram before the data itself. */
+#define LEN_WRITE_HEADER 3
+
+/* The size of the GETOUTPUTSTATE reply and the offset of the rotation count
+   within it. The rotation count is the position of the motor in degrees. */
+#define LEN_GETOUTPUTSTATE_REPLY 25
+#define ROTATION_COUNT_OFFSET 21
+
+/* The size of the GETINPUTVALUES reply and the offsets of the normalized
+   A/D value [0, 1023] and the value scaled by the sensor mode within it. */
+#define LEN_GETINPUTVALUES_REPLY 16
+#define NORMALIZED_VALUE_OFFSET 10
+#define SCALED_VALUE_OFFSET 12
+
+/* The size of the GETBATTERYLEVEL reply and the offset of the voltage in mV
+   within it. */
+#define LEN_GETBATTERYLEVEL_REPLY 5
+#define BATTERY_LEVEL_OFFSET 3
+
+/* The size of the MESSAGEREAD reply and the offsets of the message size and
+   the message within it. The size counts the message's null terminator. */
+#define LEN_MESSAGEREAD_REPLY 64
+#define MESSAGE_SIZE_OFFSET 4
+#define MESSAGE_OFFSET 5
+
+/* The size of the file system replies and the offsets of the file handle,
+   the size of the file opened by OPENREAD, and the number of bytes moved by
+   READ and WRITE within them. The data read follows the READ header. */
+#define LEN_OPENREAD_REPLY 8
+#define LEN_OPENWRITE_REPLY 4
+#define LEN_READ_REPLY_HEADER 6
+#define LEN_WRITE_REPLY 6
+#define LEN_CLOSE_REPLY 4
+#define LEN_DELETE_REPLY (3 + LEN_FILENAME)
+#define HANDLE_OFFSET 3
+#define FILE_SIZE_OFFSET 4
+#define TRANSFER_COUNT_OFFSET 4
+
+/* The most data that fits in a single WRITE telegram or READ reply. */
+#define MAX_WRITE_CHUNK (MAX_TELEGRAM - LEN_WRITE_HEADER)
+#define MAX_READ_CHUNK (MAX_TELEGRAM - LEN_READ_REPLY_HEADER)
+
+/* The number of READ or WRITE telegrams sent before waiting for their
+   replies. */
+#define TRANSFER_DEPTH 16
+
+/* The DELETE status when there is no file with the given name. */
+#define STATUS_FILE_NOT_FOUND 0x87
+
+/* The MESSAGEREAD status when there is no message in the mailbox. */
+#define STATUS_MAILBOX_EMPTY 0x40
+
+/* The NXT has 10 inboxes which programs on the brick read from. Programs
+   reply through 10 outboxes which we read as remote inboxes 10-19. */
+#define NUM_MAILBOXES 10
+#define OUTBOX_OFFSET 10
+
+/* The longest message the NXT accepts, not counting its null terminator,
+   and the size of the MESSAGEWRITE telegram that carries it. */
+#define MAX_MESSAGE 58
+#define MAX_MESSAGEWRITE                                                \
+    (LEN_PREFIX + LEN_MESSAGEWRITE_HEADER + MAX_MESSAGE + 1)
+
+/* The largest telegram the NXT will send or receive. */
+#define MAX_TELEGRAM 64
+
+/* Each telegram sent over Bluetooth is prefixed with its length as a
+   little-endian 16 bit integer. */
+#define LEN_PREFIX 2
+
+/* SETINPUTMODE sensor types and modes. */
+#define SENSOR_TYPE_SWITCH 0x01
+#define SENSOR_TYPE_LIGHT_ACTIVE 0x05
+#define SENSOR_MODE_RAW 0x00
+#define SENSOR_MODE_BOOLEAN 0x20
+
+/* SETOUTPUTSTATE mode bits. */
+#define MODE_MOTORON 0x01
+#define MODE_BRAKE 0x02
+#define MODE_REGULATED 0x04
+
+/* SETOUTPUTSTATE regulation modes. */
+#define REGULATION_MODE_IDLE 0x00
+#define REGULATION_MODE_MOTOR_SYNC 0x02
+
+/* SETOUTPUTSTATE run states. */
+#define RUN_STATE_RUNNING 0x20
+
+/* The NXT's motors are connected to ports A, B, and C. */
+#define NUM_OUTPUT_PORTS 3
+
+/* The NXT has 4 sensor ports. */
+#define NUM_INPUT_PORTS 4
+
+/* The largest normalized A/D value a sensor reports. */
+#define MAX_SENSOR_VALUE 1023
+
+/* Commands are sent in priority order. Emergency stops skip the queue and
+   go out at the next write boundary; background traffic waits behind
+   everything else and keepalives are dropped while the link is busy. */
+#define LANE_EMERGENCY 0
+#define LANE_CONTROL 1
+#define LANE_TELEMETRY 2
+#define LANE_BACKGROUND 3
+#define NUM_LANES 4
+
+static const char *lane_names[NUM_LANES] = {
+    "emergency",
+    "control",
+    "telemetry",
+    "background",
+};
+
+/* The port reported to the probes for commands that are not tied to a
+   single port. */
+#define TRACE_NO_PORT -1
+
+static unsigned long long
+monotonic_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define PYNXT_HAVE_SDT 1
+#endif
+#endif
+
+#ifdef PYNXT_HAVE_SDT
+/* Use semaphores so that we only read the clock when a tracer is actually
+   attached to one of the probes that reports the elapsed time. */
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+#define PROBE_SEMAPHORE(name)                                           \
+    unsigned short pynxt_ ## name ## _semaphore                         \
+    __attribute__((unused, section(".probes")))
+#define PROBE_ENABLED(name) __builtin_expect(pynxt_ ## name ## _semaphore, 0)
+
+PROBE_SEMAPHORE(command__encode);
+PROBE_SEMAPHORE(command__reply);
+PROBE_SEMAPHORE(command__error);
+PROBE_SEMAPHORE(telegram__write);
+PROBE_SEMAPHORE(telegram__reply);
+#endif  /* PYNXT_HAVE_SDT */
+
+/* State carried from the start of a command to its completion so that the
+   probes can report the opcode, port, and elapsed time. */
+typedef struct {
+    unsigned char opcode;
+    int port;
+    unsigned long long start;
+} nxt_trace;
+
+static inline void
+trace_begin(nxt_trace *trace, unsigned char opcode, int port, size_t nbytes)
+{
+    trace->opcode = opcode;
+    trace->port = port;
+    trace->start = 0;
+
+#ifdef PYNXT_HAVE_SDT
+    if (PROBE_ENABLED(command__encode)) {
+        DTRACE_PROBE3(pynxt, command__encode, opcode, port, nbytes);
+    }
+    if (PROBE_ENABLED(command__reply) || PROBE_ENABLED(command__error)) {
+        trace->start = monotonic_ns();
+    }
+#else
+    (void) nbytes;
+#endif  /* PYNXT_HAVE_SDT */
+}
+
+/* Fire the reply or error probe for a command. ``failed`` is returned
+   unchanged so this can wrap the call that performs the I/O. */
+static inline int
+trace_end(nxt_trace *trace, int failed)
+{
+#ifdef PYNXT_HAVE_SDT
+    unsigned long long elapsed;
+
+    if (failed && PROBE_ENABLED(command__error)) {
+        elapsed = (trace->start) ? monotonic_ns() - trace->start : 0;
+        DTRACE_PROBE3(pynxt,
+                      command__error,
+                      trace->opcode,
+                      trace->port,
+                      elapsed);
+    }
+    else if (!failed && PROBE_ENABLED(command__reply)) {
+        elapsed = (trace->start) ? monotonic_ns() - trace->start : 0;
+        DTRACE_PROBE3(pynxt,
+                      command__reply,
+                      trace->opcode,
+                      trace->port,
+                      elapsed);
+    }
+#else
+    (void) trace;
+#endif  /* PYNXT_HAVE_SDT */
+    return failed;
+}
+
 static int
 validate_port(int port)
 {
@@ -18,6 +294,19 @@ validate_port(int port)
     return 0;
 }
 
+static int
+validate_motor_port(int port)
+{
+    if (port < 1 || port > NUM_OUTPUT_PORTS) {
+        PyErr_Format(PyExc_ValueError,
+                     "Motor port must be 1-%d, got: %d",
+                     NUM_OUTPUT_PORTS,
+                     port);
+        return -1;
+    }
+    return 0;
+}
+
 static int
 validate_power(int power)
 {
@@ -30,275 +319,3364 @@ validate_power(int power)
     return 0;
 }
 
+static int
+validate_mailbox(int mailbox)
+{
+    if (mailbox < 1 || mailbox > NUM_MAILBOXES) {
+        PyErr_Format(PyExc_ValueError,
+                     "Mailbox must be 1-%d, got: %d",
+                     NUM_MAILBOXES,
+                     mailbox);
+        return -1;
+    }
+    return 0;
+}
+
+/* Check the ports passed to the methods that drive a left and right motor
+   together. */
+static int
+validate_drive_ports(int left_port, int right_port)
+{
+    if (left_port < 1 || left_port > NUM_OUTPUT_PORTS) {
+        PyErr_Format(PyExc_ValueError,
+                     "Left port must be 1-%d, got: %d",
+                     NUM_OUTPUT_PORTS,
+                     left_port);
+        return -1;
+    }
+
+    if (right_port < 1 || right_port > NUM_OUTPUT_PORTS) {
+        PyErr_Format(PyExc_ValueError,
+                     "Right port must be 1-%d, got: %d",
+                     NUM_OUTPUT_PORTS,
+                     right_port);
+        return -1;
+    }
+    return 0;
+}
+
+/* Deadlines are absolute times on the monotonic clock in nanoseconds. */
+#define NO_DEADLINE 0ULL
+
+/* Deadlines saturate here so that the time left until one always fits in a
+   long long. */
+#define MAX_DEADLINE ((unsigned long long) LLONG_MAX)
+
+static unsigned long long
+deadline_after(long long timeout_ns)
+{
+    unsigned long long now;
+
+    if (timeout_ns < 0) {
+        return NO_DEADLINE;
+    }
+
+    now = monotonic_ns();
+    if ((unsigned long long) timeout_ns > MAX_DEADLINE - now) {
+        return MAX_DEADLINE;
+    }
+    return now + timeout_ns;
+}
+
+static void
+timespec_add_ns(struct timespec *ts, unsigned long long ns)
+{
+    ns += ts->tv_nsec;
+    ts->tv_sec += ns / 1000000000ULL;
+    ts->tv_nsec = ns % 1000000000ULL;
+}
+
+/* The helpers below do not touch the Python runtime so that they may be used
+   without the GIL. They return 0 on success or -1 with errno set on failure.
+   Running past a deadline fails with ETIMEDOUT. */
+
+/* Wait for ``events`` on ``sock`` until ``deadline``. */
+static int
+wait_socket(int sock, short events, unsigned long long deadline)
+{
+    struct pollfd pfd;
+    unsigned long long now;
+    int timeout_ms;
+    int ready;
+
+    pfd.fd = sock;
+    pfd.events = events;
+
+    for (;;) {
+        if (deadline == NO_DEADLINE) {
+            timeout_ms = -1;
+        }
+        else {
+            if ((now = monotonic_ns()) >= deadline) {
+                errno = ETIMEDOUT;
+                return -1;
+            }
+            /* Round up so that we never spin with a timeout of 0. Longer
+               waits are split into several polls. */
+            timeout_ms = ((deadline - now) / 1000000 >= INT_MAX)
+                ? INT_MAX
+                : (int) ((deadline - now + 999999) / 1000000);
+        }
+
+        pfd.revents = 0;
+        if ((ready = poll(&pfd, 1, timeout_ms)) > 0) {
+            /* Errors and hangups are reported by the following read or
+               write. */
+            return 0;
+        }
+        if (ready < 0 && errno != EINTR) {
+            return -1;
+        }
+    }
+}
+
+/* Lock ``lock`` or give up at ``deadline``. */
+static int
+lock_until(pthread_mutex_t *lock, unsigned long long deadline)
+{
+    struct timespec ts;
+    unsigned long long now;
+    int err;
+
+    if (deadline == NO_DEADLINE) {
+        err = pthread_mutex_lock(lock);
+    }
+    else {
+        /* pthread_mutex_timedlock takes a deadline on the realtime clock. */
+        now = monotonic_ns();
+        clock_gettime(CLOCK_REALTIME, &ts);
+        timespec_add_ns(&ts, (deadline > now) ? deadline - now : 0);
+        err = pthread_mutex_timedlock(lock, &ts);
+    }
+
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+/* The number of times each lane was granted the link, the time spent
+   waiting for it, and the number of commands dropped. */
 typedef struct {
-    PyObject_HEAD
-    NXT nxt;
+    unsigned long long count;
+    unsigned long long shed;
+    unsigned long long total_delay_ns;
+    unsigned long long max_delay_ns;
+} lane_stats;
+
+/* A lock over the link which is granted to the waiter in the most urgent
+   lane rather than in arrival order. It is held for a whole exchange so
+   that replies are read by whoever asked for them. Once ``closed`` is set
+   the link is refused to everyone. */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t released;
+    unsigned char held;
     unsigned char closed;
-} nxtobject;
+    unsigned long waiting[NUM_LANES];
+    lane_stats stats[NUM_LANES];
+} lane_lock;
 
 static int
-check_closed(nxtobject *self) {
-    if (self->closed) {
-        PyErr_SetString(PyExc_IOError,
-                        "Cannot perform operation on closed NXT connection.");
+lane_lock_init(lane_lock *lanes)
+{
+    pthread_condattr_t attr;
+    int err;
+
+    if ((err = pthread_mutex_init(&lanes->lock, NULL))) {
+        return err;
+    }
+
+    if ((err = pthread_condattr_init(&attr))) {
+        pthread_mutex_destroy(&lanes->lock);
+        return err;
+    }
+
+    /* Waiters give up at deadlines on the monotonic clock. */
+    if (!(err = pthread_condattr_setclock(&attr, CLOCK_MONOTONIC))) {
+        err = pthread_cond_init(&lanes->released, &attr);
+    }
+    pthread_condattr_destroy(&attr);
+
+    if (err) {
+        pthread_mutex_destroy(&lanes->lock);
+    }
+    return err;
+}
+
+static void
+lane_lock_destroy(lane_lock *lanes)
+{
+    pthread_cond_destroy(&lanes->released);
+    pthread_mutex_destroy(&lanes->lock);
+}
+
+/* Record that ``lane`` was granted the link after ``delay_ns``. The caller
+   must hold ``lanes->lock``. */
+static void
+lane_record(lane_lock *lanes, int lane, unsigned long long delay_ns)
+{
+    lane_stats *stats = &lanes->stats[lane];
+
+    ++stats->count;
+    stats->total_delay_ns += delay_ns;
+    if (delay_ns > stats->max_delay_ns) {
+        stats->max_delay_ns = delay_ns;
+    }
+}
+
+/* Is anyone waiting in a lane more urgent than ``lane``? */
+static int
+lane_preempted(lane_lock *lanes, int lane)
+{
+    int n;
+
+    for (n = 0; n < lane; ++n) {
+        if (lanes->waiting[n]) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Wait for the link until ``deadline``. When ``shed`` is true the command is
+   dropped instead of queued if the link is busy.
+
+   Returns 0 when the link was acquired, 1 when the command was shed, or -1
+   with errno set on failure. A closed link fails with EBADF. */
+static int
+lane_acquire(lane_lock *lanes,
+             int lane,
+             int shed,
+             unsigned long long deadline)
+{
+    unsigned long long start = monotonic_ns();
+    struct timespec ts;
+    int err = 0;
+
+    pthread_mutex_lock(&lanes->lock);
+    if (lanes->closed) {
+        pthread_mutex_unlock(&lanes->lock);
+        errno = EBADF;
+        return -1;
+    }
+
+    if (shed && (lanes->held || lane_preempted(lanes, NUM_LANES))) {
+        ++lanes->stats[lane].shed;
+        pthread_mutex_unlock(&lanes->lock);
+        return 1;
+    }
+
+    ts.tv_sec = deadline / 1000000000ULL;
+    ts.tv_nsec = deadline % 1000000000ULL;
+
+    ++lanes->waiting[lane];
+    while (!lanes->closed && (lanes->held || lane_preempted(lanes, lane))) {
+        if (deadline == NO_DEADLINE) {
+            pthread_cond_wait(&lanes->released, &lanes->lock);
+        }
+        else if ((err = pthread_cond_timedwait(&lanes->released,
+                                               &lanes->lock,
+                                               &ts)) == ETIMEDOUT) {
+            break;
+        }
+    }
+    --lanes->waiting[lane];
+
+    if (lanes->closed || err == ETIMEDOUT) {
+        /* Less urgent waiters may have been held back by us. */
+        pthread_cond_broadcast(&lanes->released);
+        pthread_mutex_unlock(&lanes->lock);
+        errno = lanes->closed ? EBADF : ETIMEDOUT;
         return -1;
     }
+
+    lanes->held = 1;
+    lane_record(lanes, lane, monotonic_ns() - start);
+    pthread_mutex_unlock(&lanes->lock);
     return 0;
 }
 
-static PyObject*
-nxt_new(PyTypeObject *cls, PyObject *args, PyObject *kwargs)
+/* Give up the link after an exchange which returned ``status``. errno is
+   preserved, except that an exchange which failed because the link was
+   closed under it fails with EBADF. */
+static void
+lane_release(lane_lock *lanes, int status)
 {
-    char *keywords[] = {"mac_address", NULL};
-    char *mac_address;
-    nxtobject *self;
+    int err = errno;
 
-    if (!PyArg_ParseTupleAndKeywords(args,
-                                     kwargs,
-                                     "s",
-                                     keywords,
-                                     &mac_address)) {
-        return NULL;
+    pthread_mutex_lock(&lanes->lock);
+    if (status && lanes->closed) {
+        err = EBADF;
     }
+    lanes->held = 0;
+    pthread_cond_broadcast(&lanes->released);
+    pthread_mutex_unlock(&lanes->lock);
+    errno = err;
+}
 
-    if (!(self = (nxtobject*) cls->tp_alloc(cls, 0))) {
-        return NULL;
+/* Refuse the link to everyone from now on. Callers waiting for it fail
+   with EBADF. */
+static void
+lane_close(lane_lock *lanes)
+{
+    pthread_mutex_lock(&lanes->lock);
+    lanes->closed = 1;
+    pthread_cond_broadcast(&lanes->released);
+    pthread_mutex_unlock(&lanes->lock);
+}
+
+/* Wait for the exchange holding the link, if any, to finish. */
+static void
+lane_wait_idle(lane_lock *lanes)
+{
+    pthread_mutex_lock(&lanes->lock);
+    while (lanes->held) {
+        pthread_cond_wait(&lanes->released, &lanes->lock);
     }
+    pthread_mutex_unlock(&lanes->lock);
+}
 
-    if (NXT_init(&self->nxt) || NXT_connect(&self->nxt, mac_address)) {
-        self->closed = 1;
-        Py_XDECREF(self);
-        PyErr_Format(PyExc_IOError,
-                     "Failed to connect to a device at MAC: %s",
-                     mac_address);
+/* The framing state of the non-blocking socket to the NXT.
+
+   The NXT answers requests in order, so every telegram that asks for a reply
+   is given the next sequence number in ``tx_seq`` and the replies are
+   numbered in ``rx_seq`` as they are read. When a call times out its reply
+   is left on the socket; the next call that reads replies discards
+   everything before its own sequence number so the connection remains
+   usable. Likewise, the unsent tail of a telegram that timed out part way
+   through its write is kept in ``pending`` and sent before anything else.
+
+   Emergency commands are written while another call may be waiting for its
+   replies, so writes are serialized by ``write_lock`` which guards
+   ``tx_seq`` and ``pending``. Only the holder of the lane lock may send
+   telegrams that ask for a reply, and it alone reads from the socket. The
+   counters are only updated atomically. */
+typedef struct {
+    int sock;
+    pthread_mutex_t write_lock;
+    unsigned long long tx_seq;
+    unsigned long long rx_seq;
+    unsigned char rx_buf[LEN_PREFIX + MAX_TELEGRAM];
+    size_t rx_len;
+    unsigned char *pending;
+    size_t pending_len;
+    unsigned long timeouts;
+    unsigned long late_replies;
+} connection;
+
+static inline void
+count_timeout(connection *conn)
+{
+    __atomic_add_fetch(&conn->timeouts, 1, __ATOMIC_RELAXED);
+}
+
+/* Write as much of ``buf`` as we can before ``deadline``. The number of
+   bytes written is stored in ``written`` even on failure. */
+static int
+conn_write(connection *conn,
+           const unsigned char *buf,
+           size_t len,
+           unsigned long long deadline,
+           size_t *written)
+{
+    ssize_t n;
+
+    *written = 0;
+    while (*written < len) {
+        if ((n = write(conn->sock, buf + *written, len - *written)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                return -1;
+            }
+            if (wait_socket(conn->sock, POLLOUT, deadline)) {
+                return -1;
+            }
+            continue;
+        }
+        *written += n;
+    }
+    return 0;
+}
+
+/* Send the tail of a telegram that was cut off by a timeout. */
+static int
+conn_flush(connection *conn, unsigned long long deadline)
+{
+    size_t written;
+    int status;
+
+    if (!conn->pending_len) {
+        return 0;
+    }
+
+    status = conn_write(conn,
+                        conn->pending,
+                        conn->pending_len,
+                        deadline,
+                        &written);
+    conn->pending_len -= written;
+    if (conn->pending_len) {
+        memmove(conn->pending, conn->pending + written, conn->pending_len);
+    }
+    else {
+        free(conn->pending);
+        conn->pending = NULL;
+    }
+    return status;
+}
+
+/* Send a buffer of already framed telegrams, ``nreplies`` of which ask for a
+   reply. The telegrams are committed once any byte of them has been written,
+   after which their replies are expected even if we time out. */
+static int
+conn_send(connection *conn,
+          const unsigned char *buf,
+          size_t len,
+          unsigned long long nreplies,
+          unsigned long long deadline)
+{
+    size_t written;
+    int status;
+    int err;
+
+    if (conn_flush(conn, deadline)) {
+        return -1;
+    }
+
+#ifdef PYNXT_HAVE_SDT
+    if (PROBE_ENABLED(telegram__write)) {
+        DTRACE_PROBE2(pynxt, telegram__write, buf[LEN_PREFIX + 1], len);
+    }
+#endif  /* PYNXT_HAVE_SDT */
+
+    status = conn_write(conn, buf, len, deadline, &written);
+    err = errno;
+    if (written && nreplies) {
+        conn->tx_seq += nreplies;
+    }
+
+    if (status && written) {
+        /* Keep the rest of the telegrams so that the stream stays framed. */
+        if (!(conn->pending = malloc(len - written))) {
+            errno = ENOMEM;
+            return -1;
+        }
+        memcpy(conn->pending, buf + written, len - written);
+        conn->pending_len = len - written;
+        errno = err;
+    }
+    return status;
+}
+
+/* ``conn_send`` under the write lock. */
+static int
+conn_send_locked(connection *conn,
+                 const unsigned char *buf,
+                 size_t len,
+                 unsigned long long nreplies,
+                 unsigned long long deadline)
+{
+    int status;
+    int err;
+
+    if (lock_until(&conn->write_lock, deadline)) {
+        return -1;
+    }
+    status = conn_send(conn, buf, len, nreplies, deadline);
+    err = errno;
+    pthread_mutex_unlock(&conn->write_lock);
+    errno = err;
+    return status;
+}
+
+/* Read replies until the reply with sequence number ``seq`` arrives, and
+   copy it without the length prefix into ``reply`` which must have room for
+   ``MAX_TELEGRAM`` bytes. Earlier replies belong to calls that timed out
+   and are discarded. */
+static int
+conn_recv(connection *conn,
+          unsigned long long seq,
+          unsigned char *reply,
+          size_t *len,
+          unsigned long long deadline)
+{
+    size_t need;
+    size_t frame_len;
+    ssize_t n;
+
+    while (conn->rx_seq < seq) {
+        need = LEN_PREFIX;
+        if (conn->rx_len >= LEN_PREFIX) {
+            frame_len = conn->rx_buf[0] | (conn->rx_buf[1] << 8);
+            if (frame_len > MAX_TELEGRAM) {
+                errno = EMSGSIZE;
+                return -1;
+            }
+            need += frame_len;
+        }
+
+        if (conn->rx_len < need) {
+            /* Only read up to the end of the current frame so that the next
+               frame stays on the socket. */
+            n = read(conn->sock,
+                     conn->rx_buf + conn->rx_len,
+                     need - conn->rx_len);
+            if (n > 0) {
+                conn->rx_len += n;
+                continue;
+            }
+            if (!n) {
+                errno = ECONNRESET;
+                return -1;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                return -1;
+            }
+            if (wait_socket(conn->sock, POLLIN, deadline)) {
+                return -1;
+            }
+            continue;
+        }
+
+        if (++conn->rx_seq == seq) {
+            *len = need - LEN_PREFIX;
+            memcpy(reply, conn->rx_buf + LEN_PREFIX, *len);
+
+#ifdef PYNXT_HAVE_SDT
+            if (PROBE_ENABLED(telegram__reply)) {
+                DTRACE_PROBE3(pynxt,
+                              telegram__reply,
+                              (*len > 1) ? reply[1] : 0,
+                              (*len > 2) ? reply[2] : 0,
+                              *len);
+            }
+#endif  /* PYNXT_HAVE_SDT */
+        }
+        else {
+            __atomic_add_fetch(&conn->late_replies, 1, __ATOMIC_RELAXED);
+        }
+        conn->rx_len = 0;
+    }
+    return 0;
+}
+
+/* Read and discard the replies to calls that timed out. A request cut off
+   part way through its write is finished first, since the NXT cannot
+   answer it before then. */
+static int
+conn_drain(connection *conn, unsigned long long deadline)
+{
+    unsigned char scratch[MAX_TELEGRAM];
+    size_t len;
+    int status;
+    int err;
+
+    if (conn->rx_seq == conn->tx_seq) {
+        return 0;
+    }
+
+    if (lock_until(&conn->write_lock, deadline)) {
+        return -1;
+    }
+    status = conn_flush(conn, deadline);
+    err = errno;
+    pthread_mutex_unlock(&conn->write_lock);
+    errno = err;
+    if (status) {
+        return -1;
+    }
+
+    if (conn_recv(conn, conn->tx_seq, scratch, &len, deadline)) {
+        return -1;
+    }
+    __atomic_add_fetch(&conn->late_replies, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/* Check that ``buf`` is a successful reply to ``opcode`` which is at least
+   ``minlen`` bytes long. */
+static int
+check_reply(const unsigned char *buf,
+            size_t len,
+            unsigned char opcode,
+            size_t minlen)
+{
+    if (len < minlen || len < 3 || buf[0] != REPLY || buf[1] != opcode) {
+        errno = EPROTO;
+        return -1;
+    }
+
+    if (buf[2]) {
+        /* The NXT reported an error for the command. */
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+static inline long
+read_int32(const unsigned char *buf)
+{
+    return (long) (int32_t) ((uint32_t) buf[0] |
+                             ((uint32_t) buf[1] << 8) |
+                             ((uint32_t) buf[2] << 16) |
+                             ((uint32_t) buf[3] << 24));
+}
+
+static inline unsigned int
+read_uint16(const unsigned char *buf)
+{
+    return buf[0] | (buf[1] << 8);
+}
+
+static inline int
+read_int16(const unsigned char *buf)
+{
+    return (int16_t) read_uint16(buf);
+}
+
+/* A single odometry estimate. ``t`` is seconds on the monotonic clock,
+   ``x`` and ``y`` are in the units of the wheel radius, and ``heading`` is
+   in radians counter-clockwise from the starting heading. */
+typedef struct {
+    double t;
+    double x;
+    double y;
+    double heading;
+} pose_sample;
+
+/* How long an odometry sample waits for the NXT when there is no timeout, so
+   that a stalled link cannot keep the thread from stopping. */
+#define ODOMETRY_TIMEOUT_NS 1000000000LL
+
+/* The state of the background thread which polls the drive motors'
+   tachometers and integrates the robot's pose. ``running`` and ``thread``
+   are guarded by ``join_lock``, which is held while the thread is started
+   or joined so that it is only ever joined once. Everything below ``lock``
+   is guarded by it. */
+typedef struct {
+    pthread_mutex_t join_lock;
+    unsigned char running;
+    pthread_t thread;
+    int left_port;
+    int right_port;
+    double distance_per_degree;
+    double track_width;
+    unsigned long long period_ns;
+    long long timeout_ns;
+
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    unsigned char stop;
+    unsigned char exited;
+    unsigned char have_counts;
+    int error;
+    long left_count;
+    long right_count;
+    pose_sample pose;
+    pose_sample *history;
+    size_t history_size;
+    size_t history_len;
+    size_t history_head;
+} odometry;
+
+/* How to turn the A/D values read from a sensor port into calibrated
+   values. Each value is first mapped from ``[min, max]`` onto ``[0, 1]``
+   and clamped, then optionally passed through a lookup table which is
+   linearly interpolated, and finally optionally smoothed with an
+   exponential low-pass filter. */
+typedef struct {
+    double min;
+    double scale;
+    double *table;
+    size_t table_size;
+    double smoothing;
+    /* The filter state for values read with ``read_calibrated``. */
+    double filtered;
+    unsigned char primed;
+} calibration;
+
+/* The conversion kernels below work on whole buffers and keep the loops
+   free of branches and calls so that the compiler can vectorize them. They
+   do not touch the Python runtime. */
+
+static void
+calibrate_normalize(const uint16_t *raw,
+                    double *out,
+                    size_t n,
+                    double min,
+                    double scale)
+{
+    size_t i;
+    double v;
+
+    for (i = 0; i < n; ++i) {
+        v = (raw[i] - min) * scale;
+        v = (v < 0.0) ? 0.0 : v;
+        out[i] = (v > 1.0) ? 1.0 : v;
+    }
+}
+
+/* Map values in ``[0, 1]`` through ``table``, interpolating between the
+   entries, which are evenly spaced over ``[0, 1]``. */
+static void
+calibrate_lookup(double *values,
+                 size_t n,
+                 const double *table,
+                 size_t table_size)
+{
+    double last = (double) (table_size - 1);
+    double position;
+    double frac;
+    size_t index;
+    size_t i;
+
+    for (i = 0; i < n; ++i) {
+        position = values[i] * last;
+        index = (size_t) position;
+        /* Only a value of exactly 1.0 lands on the last entry. */
+        index = (index > table_size - 2) ? table_size - 2 : index;
+        frac = position - index;
+        values[i] = table[index] + frac * (table[index + 1] - table[index]);
+    }
+}
+
+/* Apply ``y += (1 - smoothing) * (x - y)``. This is a recurrence so it
+   cannot be vectorized, but it does the least work per sample. */
+static void
+calibrate_smooth(double *values,
+                 size_t n,
+                 double smoothing,
+                 double *state,
+                 unsigned char *primed)
+{
+    double gain = 1.0 - smoothing;
+    double y = *state;
+    size_t i = 0;
+
+    if (!n) {
+        return;
+    }
+
+    if (!*primed) {
+        y = values[i++];
+        *primed = 1;
+    }
+    for (; i < n; ++i) {
+        y += gain * (values[i] - y);
+        values[i] = y;
+    }
+    *state = y;
+}
+
+static void
+calibration_apply(const calibration *cal,
+                  const uint16_t *raw,
+                  double *out,
+                  size_t n,
+                  double *state,
+                  unsigned char *primed)
+{
+    calibrate_normalize(raw, out, n, cal->min, cal->scale);
+    if (cal->table) {
+        calibrate_lookup(out, n, cal->table, cal->table_size);
+    }
+    if (cal->smoothing > 0) {
+        calibrate_smooth(out, n, cal->smoothing, state, primed);
+    }
+}
+
+static void
+calibration_reset(calibration *cal)
+{
+    PyMem_Free(cal->table);
+    cal->min = 0;
+    cal->scale = 1.0 / MAX_SENSOR_VALUE;
+    cal->table = NULL;
+    cal->table_size = 0;
+    cal->smoothing = 0;
+    cal->filtered = 0;
+    cal->primed = 0;
+}
+
+typedef struct {
+    PyObject_HEAD
+    NXT nxt;
+    unsigned char closed;
+    /* The default timeout for every call in nanoseconds, or -1 to wait
+       forever. */
+    long long timeout_ns;
+    /* The last battery level read in mV, or -1 before the first read. */
+    long battery_level;
+    /* Serializes every exchange on the socket between Python threads and
+       the odometry thread in priority order. */
+    lane_lock lanes;
+    connection conn;
+    odometry odom;
+    calibration calibrations[NUM_INPUT_PORTS];
+} nxtobject;
+
+/* Raised when a call to the NXT does not finish before its deadline. */
+static PyObject *NXTTimeout;
+
+static int
+check_closed(nxtobject *self) {
+    if (self->closed) {
+        PyErr_SetString(PyExc_IOError,
+                        "Cannot perform operation on closed NXT connection.");
+        return -1;
+    }
+    return 0;
+}
+
+/* Raise the error for a failed call from errno: ``NXTTimeout`` when the
+   deadline passed and ``IOError`` otherwise, noting when the connection was
+   closed during the call.
+
+   Returns NULL so that callers may ``return raise_io_error(...)``. */
+static PyObject*
+raise_io_error(const char *format, ...)
+{
+    int err = errno;
+    PyObject *message;
+    va_list ap;
+
+    va_start(ap, format);
+    message = PyUnicode_FromFormatV(format, ap);
+    va_end(ap);
+
+    if (!message) {
+        return NULL;
+    }
+
+    if (err == ETIMEDOUT) {
+        PyErr_Format(NXTTimeout, "%U: timed out", message);
+    }
+    else if (err == EBADF) {
+        PyErr_Format(PyExc_IOError, "%U: connection closed", message);
+    }
+    else {
+        PyErr_SetObject(PyExc_IOError, message);
+    }
+    Py_DECREF(message);
+    return NULL;
+}
+
+/* Convert a timeout in seconds from Python into nanoseconds. ``None`` means
+   wait forever which is stored as -1. */
+static int
+parse_timeout(PyObject *timeout, long long *timeout_ns)
+{
+    double seconds;
+
+    if (timeout == Py_None) {
+        *timeout_ns = -1;
+        return 0;
+    }
+
+    if ((seconds = PyFloat_AsDouble(timeout)) == -1.0 && PyErr_Occurred()) {
+        return -1;
+    }
+
+    if (!(seconds >= 0)) {
+        PyErr_Format(PyExc_ValueError,
+                     "Timeout must be non-negative or None, got: %R",
+                     timeout);
+        return -1;
+    }
+
+    if (!isfinite(seconds)) {
+        PyErr_Format(PyExc_ValueError,
+                     "Timeout must be finite or None, got: %R",
+                     timeout);
+        return -1;
+    }
+
+    /* Converting a value which does not fit in a long long is undefined, so
+       clamp timeouts of more than about 292 years first. */
+    seconds *= 1e9;
+    *timeout_ns = (seconds >= (double) LLONG_MAX)
+        ? LLONG_MAX
+        : (long long) seconds;
+    return 0;
+}
+
+/* Compute the deadline for a call from its ``timeout`` argument, which is
+   NULL when it was not passed and the connection's default applies. */
+static int
+call_deadline(nxtobject *self,
+              PyObject *timeout,
+              unsigned long long *deadline)
+{
+    long long timeout_ns = self->timeout_ns;
+
+    if (timeout && parse_timeout(timeout, &timeout_ns)) {
+        return -1;
+    }
+
+    *deadline = deadline_after(timeout_ns);
+    return 0;
+}
+
+/* Send telegrams that do not ask for a reply with the GIL released. This
+   waits for the link in ``lane`` and fires the command probes; ``port`` is
+   only used for tracing. Emergency commands only wait for the write in
+   progress, and background commands are dropped while the link is busy.
+
+   Returns 0 on success, including when the command was dropped, or -1 with
+   errno set on failure. No Python exception is raised so that the caller
+   can report which command failed. */
+static int
+send_command(nxtobject *self,
+             int lane,
+             int port,
+             const unsigned char *buf,
+             size_t len,
+             unsigned long long deadline)
+{
+    connection *conn = &self->conn;
+    unsigned long long start;
+    nxt_trace trace;
+    int status;
+    int closed;
+    int err;
+
+    trace_begin(&trace, buf[LEN_PREFIX + 1], port, len);
+
+    Py_BEGIN_ALLOW_THREADS
+    if (lane == LANE_EMERGENCY) {
+        start = monotonic_ns();
+        if (!(status = lock_until(&conn->write_lock, deadline))) {
+            pthread_mutex_lock(&self->lanes.lock);
+            lane_record(&self->lanes, lane, monotonic_ns() - start);
+            closed = self->lanes.closed;
+            pthread_mutex_unlock(&self->lanes.lock);
+
+            /* close() shuts the socket down before it takes the write lock,
+               so a write in progress fails rather than blocking it. */
+            if (closed) {
+                errno = EBADF;
+                status = -1;
+            }
+            else if ((status = conn_send(conn, buf, len, 0, deadline))) {
+                err = errno;
+                pthread_mutex_lock(&self->lanes.lock);
+                closed = self->lanes.closed;
+                pthread_mutex_unlock(&self->lanes.lock);
+                errno = closed ? EBADF : err;
+            }
+            err = errno;
+            pthread_mutex_unlock(&conn->write_lock);
+            errno = err;
+        }
+    }
+    else if (!(status = lane_acquire(&self->lanes,
+                                     lane,
+                                     lane == LANE_BACKGROUND,
+                                     deadline))) {
+        status = conn_send_locked(conn, buf, len, 0, deadline);
+        lane_release(&self->lanes, status);
+    }
+    else if (status > 0) {
+        status = 0;
+    }
+    err = errno;
+    Py_END_ALLOW_THREADS
+
+    errno = err;
+    if (status && err == ETIMEDOUT) {
+        count_timeout(conn);
+    }
+    return trace_end(&trace, status);
+}
+
+/* Send a buffer of telegrams which each ask for a reply and wait for all
+   ``nreplies`` of the replies with the GIL released. The requests go out in
+   a single write so that the NXT can work on the next one while we read
+   the reply to the last. Reply ``n`` is copied into ``replies + n *
+   MAX_TELEGRAM`` and its length is stored in ``lens[n]``. The replies are
+   not checked. When ``shed`` is true nothing is sent if the link is busy.
+
+   Returns 0 on success, 1 when the requests were shed, or -1 with errno set
+   on failure. */
+static int
+send_requests(nxtobject *self,
+              int lane,
+              int shed,
+              const unsigned char *requests,
+              size_t requests_len,
+              size_t nreplies,
+              unsigned char *replies,
+              size_t *lens,
+              unsigned long long deadline)
+{
+    connection *conn = &self->conn;
+    unsigned long long seq;
+    size_t n;
+    int status;
+    int err;
+
+    Py_BEGIN_ALLOW_THREADS
+    if (!(status = lane_acquire(&self->lanes, lane, shed, deadline))) {
+        status = conn_send_locked(conn,
+                                  requests,
+                                  requests_len,
+                                  nreplies,
+                                  deadline);
+        seq = conn->tx_seq - nreplies + 1;
+        for (n = 0; !status && n < nreplies; ++n) {
+            status = conn_recv(conn,
+                               seq + n,
+                               replies + n * MAX_TELEGRAM,
+                               &lens[n],
+                               deadline);
+        }
+        lane_release(&self->lanes, status);
+    }
+    err = errno;
+    Py_END_ALLOW_THREADS
+
+    errno = err;
+    if (status < 0 && err == ETIMEDOUT) {
+        count_timeout(conn);
+    }
+    return status;
+}
+
+/* Send a single telegram and wait for its reply with the GIL released. The
+   reply is checked against the opcode of the request and must be at least
+   ``reply_minlen`` bytes. ``reply`` must have room for ``MAX_TELEGRAM``
+   bytes. ``shed`` is as for ``send_requests``.
+
+   Returns 0 on success, 1 when the request was shed, or -1 with errno set
+   on failure. */
+static int
+send_request(nxtobject *self,
+             int lane,
+             int shed,
+             int port,
+             const unsigned char *request,
+             size_t request_len,
+             unsigned char *reply,
+             size_t reply_minlen,
+             unsigned long long deadline)
+{
+    nxt_trace trace;
+    size_t len;
+    int status;
+
+    trace_begin(&trace, request[LEN_PREFIX + 1], port, request_len);
+    if (!(status = send_requests(self,
+                                 lane,
+                                 shed,
+                                 request,
+                                 request_len,
+                                 1,
+                                 reply,
+                                 &len,
+                                 deadline))) {
+        status = check_reply(reply,
+                             len,
+                             request[LEN_PREFIX + 1],
+                             reply_minlen);
+    }
+    trace_end(&trace, status < 0);
+    return status;
+}
+
+/* The encoders below write a single framed telegram into ``buf``. Ports are
+   1-indexed like the rest of the Python API.
+
+   They return the number of bytes written to ``buf``. */
+
+/* Encode a telegram with no arguments such as KEEPALIVE. */
+static size_t
+encode_simple(unsigned char *buf, unsigned char type, unsigned char opcode)
+{
+    buf[0] = 2;
+    buf[1] = 0;
+    buf[2] = type;
+    buf[3] = opcode;
+    return LEN_PREFIX + 2;
+}
+
+static size_t
+encode_playtone(unsigned char *buf,
+                unsigned short freq,
+                unsigned short time)
+{
+    buf[0] = LEN_PLAYTONE;
+    buf[1] = 0;
+    buf[2] = DIRECT_COMMAND_NOREPLY;
+    buf[3] = OP_PLAYTONE;
+    buf[4] = freq & 0xff;
+    buf[5] = freq >> 8;
+    buf[6] = time & 0xff;
+    buf[7] = time >> 8;
+    return LEN_PREFIX + LEN_PLAYTONE;
+}
+
+static size_t
+encode_setinputmode(unsigned char *buf,
+                    int port,
+                    unsigned char sensor_type,
+                    unsigned char sensor_mode)
+{
+    buf[0] = LEN_SETINPUTMODE;
+    buf[1] = 0;
+    buf[2] = DIRECT_COMMAND_NOREPLY;
+    buf[3] = OP_SETINPUTMODE;
+    buf[4] = (unsigned char) (port - 1);
+    buf[5] = sensor_type;
+    buf[6] = sensor_mode;
+    return LEN_PREFIX + LEN_SETINPUTMODE;
+}
+
+static size_t
+encode_getinputvalues(unsigned char *buf, int port)
+{
+    buf[0] = LEN_GETINPUTVALUES;
+    buf[1] = 0;
+    buf[2] = DIRECT_COMMAND;
+    buf[3] = OP_GETINPUTVALUES;
+    buf[4] = (unsigned char) (port - 1);
+    return LEN_PREFIX + LEN_GETINPUTVALUES;
+}
+
+/* Encode a SETOUTPUTSTATE telegram which does not request a reply. */
+static size_t
+encode_setoutputstate(unsigned char *buf,
+                      int port,
+                      int power,
+                      unsigned char mode,
+                      unsigned char regulation_mode,
+                      int turn_ratio)
+{
+    buf[0] = LEN_SETOUTPUTSTATE;
+    buf[1] = 0;
+    buf[2] = DIRECT_COMMAND_NOREPLY;
+    buf[3] = OP_SETOUTPUTSTATE;
+    buf[4] = (unsigned char) (port - 1);
+    buf[5] = (unsigned char) (signed char) power;
+    buf[6] = mode;
+    buf[7] = regulation_mode;
+    buf[8] = (unsigned char) (signed char) turn_ratio;
+    buf[9] = RUN_STATE_RUNNING;
+    /* A tacho limit of 0 means run forever. The protocol gives the limit
+       bytes 8-12 of the telegram, so all five are cleared. */
+    buf[10] = 0;
+    buf[11] = 0;
+    buf[12] = 0;
+    buf[13] = 0;
+    buf[14] = 0;
+    return LEN_PREFIX + LEN_SETOUTPUTSTATE;
+}
+
+/* Encode a SETOUTPUTSTATE telegram which holds a motor still. */
+static size_t
+encode_stopmotor(unsigned char *buf, int port)
+{
+    return encode_setoutputstate(buf,
+                                 port,
+                                 0,
+                                 MODE_MOTORON | MODE_BRAKE,
+                                 REGULATION_MODE_IDLE,
+                                 0);
+}
+
+static size_t
+encode_getoutputstate(unsigned char *buf, int port)
+{
+    buf[0] = LEN_GETOUTPUTSTATE;
+    buf[1] = 0;
+    buf[2] = DIRECT_COMMAND;
+    buf[3] = OP_GETOUTPUTSTATE;
+    buf[4] = (unsigned char) (port - 1);
+    return LEN_PREFIX + LEN_GETOUTPUTSTATE;
+}
+
+/* Encode a MESSAGEWRITE telegram which does not request a reply. ``buf``
+   must have room for ``LEN_PREFIX + LEN_MESSAGEWRITE_HEADER + len + 1``
+   bytes. */
+static size_t
+encode_messagewrite(unsigned char *buf,
+                    int mailbox,
+                    const void *message,
+                    size_t len)
+{
+    size_t size = LEN_MESSAGEWRITE_HEADER + len + 1;
+
+    buf[0] = size & 0xff;
+    buf[1] = size >> 8;
+    buf[2] = DIRECT_COMMAND_NOREPLY;
+    buf[3] = OP_MESSAGEWRITE;
+    buf[4] = (unsigned char) (mailbox - 1);
+    buf[5] = (unsigned char) (len + 1);
+    memcpy(buf + LEN_PREFIX + LEN_MESSAGEWRITE_HEADER, message, len);
+    buf[LEN_PREFIX + size - 1] = '\0';
+    return LEN_PREFIX + size;
+}
+
+/* Encode a MESSAGEREAD telegram for one of the outboxes of the program
+   running on the NXT. */
+static size_t
+encode_messageread(unsigned char *buf, int mailbox, int remove)
+{
+    buf[0] = LEN_MESSAGEREAD;
+    buf[1] = 0;
+    buf[2] = DIRECT_COMMAND;
+    buf[3] = OP_MESSAGEREAD;
+    buf[4] = (unsigned char) (mailbox - 1 + OUTBOX_OFFSET);
+    buf[5] = (unsigned char) (mailbox - 1);
+    buf[6] = (remove) ? 1 : 0;
+    return LEN_PREFIX + LEN_MESSAGEREAD;
+}
+
+/* Does the firmware run the file ``name`` in place? Such files must be stored
+   contiguously in flash, which is what OPENWRITELINEAR asks for. */
+static int
+is_linear_file(const char *name)
+{
+    static const char *extensions[] = {".rxe", ".ric", ".rtm", ".sys"};
+    const char *ext = strrchr(name, '.');
+    size_t n;
+
+    if (!ext) {
+        return 0;
+    }
+
+    for (n = 0; n < sizeof(extensions) / sizeof(extensions[0]); ++n) {
+        if (!strcasecmp(ext, extensions[n])) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Encode a file system telegram which takes just a file name. */
+static size_t
+encode_filename_command(unsigned char *buf,
+                        unsigned char opcode,
+                        const char *name)
+{
+    buf[0] = 2 + LEN_FILENAME;
+    buf[1] = 0;
+    buf[2] = SYSTEM_COMMAND;
+    buf[3] = opcode;
+    memset(buf + 4, 0, LEN_FILENAME);
+    memcpy(buf + 4, name, strlen(name));
+    return LEN_PREFIX + 2 + LEN_FILENAME;
+}
+
+static size_t
+encode_openwrite(unsigned char *buf, const char *name, uint32_t size)
+{
+    size_t len = encode_filename_command(buf,
+                                         is_linear_file(name) ?
+                                         OP_OPENWRITELINEAR :
+                                         OP_OPENWRITE,
+                                         name);
+
+    buf[0] = LEN_OPENWRITE;
+    buf[len++] = size & 0xff;
+    buf[len++] = (size >> 8) & 0xff;
+    buf[len++] = (size >> 16) & 0xff;
+    buf[len++] = size >> 24;
+    return len;
+}
+
+static size_t
+encode_write(unsigned char *buf,
+             unsigned char handle,
+             const unsigned char *data,
+             size_t len)
+{
+    buf[0] = (unsigned char) (LEN_WRITE_HEADER + len);
+    buf[1] = 0;
+    buf[2] = SYSTEM_COMMAND;
+    buf[3] = OP_WRITE;
+    buf[4] = handle;
+    memcpy(buf + LEN_PREFIX + LEN_WRITE_HEADER, data, len);
+    return LEN_PREFIX + LEN_WRITE_HEADER + len;
+}
+
+static size_t
+encode_read(unsigned char *buf, unsigned char handle, size_t len)
+{
+    buf[0] = LEN_READ;
+    buf[1] = 0;
+    buf[2] = SYSTEM_COMMAND;
+    buf[3] = OP_READ;
+    buf[4] = handle;
+    buf[5] = len & 0xff;
+    buf[6] = len >> 8;
+    return LEN_PREFIX + LEN_READ;
+}
+
+static size_t
+encode_close(unsigned char *buf, unsigned char handle)
+{
+    buf[0] = LEN_CLOSE;
+    buf[1] = 0;
+    buf[2] = SYSTEM_COMMAND;
+    buf[3] = OP_CLOSE;
+    buf[4] = handle;
+    return LEN_PREFIX + LEN_CLOSE;
+}
+
+/* Integrate a new pair of rotation counts into the pose with the
+   differential drive model. The caller must hold ``odom->lock``. */
+static void
+odometry_update(odometry *odom, long left, long right, double t)
+{
+    double left_distance;
+    double right_distance;
+    double distance;
+    double turn;
+    double mid_heading;
+
+    if (odom->have_counts) {
+        left_distance = (left - odom->left_count) * odom->distance_per_degree;
+        right_distance = ((right - odom->right_count) *
+                          odom->distance_per_degree);
+        distance = (left_distance + right_distance) / 2;
+        turn = (right_distance - left_distance) / odom->track_width;
+        mid_heading = odom->pose.heading + turn / 2;
+
+        odom->pose.x += distance * cos(mid_heading);
+        odom->pose.y += distance * sin(mid_heading);
+        odom->pose.heading += turn;
+    }
+    odom->left_count = left;
+    odom->right_count = right;
+    odom->have_counts = 1;
+    odom->pose.t = t;
+
+    odom->history[odom->history_head] = odom->pose;
+    odom->history_head = (odom->history_head + 1) % odom->history_size;
+    if (odom->history_len < odom->history_size) {
+        ++odom->history_len;
+    }
+}
+
+/* The body of the odometry thread. This never takes the GIL. Both
+   GETOUTPUTSTATE requests are sent in a single write so that the left and
+   right counts are sampled as close together as possible. A sample that
+   times out is skipped, and no new requests are sent until its replies have
+   been drained so that a slow link does not build up a backlog. Any other
+   failure stops the thread. */
+static void*
+odometry_thread(void *arg)
+{
+    nxtobject *self = arg;
+    odometry *odom = &self->odom;
+    connection *conn = &self->conn;
+    unsigned char request[2 * (LEN_PREFIX + LEN_GETOUTPUTSTATE)];
+    unsigned char reply[MAX_TELEGRAM];
+    long counts[2];
+    size_t len;
+    unsigned long long io_deadline;
+    unsigned long long seq;
+    struct timespec deadline;
+    struct timespec now;
+    int status;
+    int err;
+    int n;
+
+    len = encode_getoutputstate(request, odom->left_port);
+    encode_getoutputstate(request + len, odom->right_port);
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+
+    pthread_mutex_lock(&odom->lock);
+    while (!odom->stop) {
+        pthread_mutex_unlock(&odom->lock);
+
+        io_deadline = deadline_after(odom->timeout_ns);
+        if (!(status = lane_acquire(&self->lanes,
+                                    LANE_TELEMETRY,
+                                    0,
+                                    io_deadline))) {
+            status = (conn_drain(conn, io_deadline) ||
+                      conn_send_locked(conn,
+                                       request,
+                                       sizeof(request),
+                                       2,
+                                       io_deadline));
+            seq = conn->tx_seq - 1;
+            for (n = 0; !status && n < 2; ++n) {
+                status = (conn_recv(conn, seq + n, reply, &len, io_deadline) ||
+                          check_reply(reply,
+                                      len,
+                                      OP_GETOUTPUTSTATE,
+                                      LEN_GETOUTPUTSTATE_REPLY));
+                if (!status) {
+                    counts[n] = read_int32(reply + ROTATION_COUNT_OFFSET);
+                }
+            }
+            lane_release(&self->lanes, status);
+        }
+        err = errno;
+
+        pthread_mutex_lock(&odom->lock);
+        if (status) {
+            /* Closing the connection stops the thread without an error. */
+            if (err == EBADF) {
+                break;
+            }
+            if (err != ETIMEDOUT) {
+                odom->error = (err) ? err : EIO;
+                break;
+            }
+            count_timeout(conn);
+        }
+        else {
+            odometry_update(odom, counts[0], counts[1], monotonic_ns() / 1e9);
+        }
+
+        timespec_add_ns(&deadline, odom->period_ns);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (now.tv_sec > deadline.tv_sec ||
+            (now.tv_sec == deadline.tv_sec &&
+             now.tv_nsec > deadline.tv_nsec)) {
+            /* The link could not keep up with the requested rate; don't try
+               to catch up with a burst of requests. */
+            deadline = now;
+        }
+
+        while (!odom->stop &&
+               pthread_cond_timedwait(&odom->wake,
+                                      &odom->lock,
+                                      &deadline) != ETIMEDOUT) {
+        }
+    }
+    odom->exited = 1;
+    pthread_mutex_unlock(&odom->lock);
+    return NULL;
+}
+
+/* Stop the odometry thread if it is running. The caller must hold
+   ``odom->join_lock``. */
+static void
+odometry_join(odometry *odom)
+{
+    if (!odom->running) {
+        return;
+    }
+
+    pthread_mutex_lock(&odom->lock);
+    odom->stop = 1;
+    pthread_cond_signal(&odom->wake);
+    pthread_mutex_unlock(&odom->lock);
+
+    pthread_join(odom->thread, NULL);
+    odom->running = 0;
+}
+
+/* Stop the odometry thread if it is running. The pose and history remain
+   readable. This may be called with or without the GIL. A sample in
+   progress finishes first, which takes at most the sample's timeout. */
+static void
+odometry_stop(odometry *odom)
+{
+    pthread_mutex_lock(&odom->join_lock);
+    odometry_join(odom);
+    pthread_mutex_unlock(&odom->join_lock);
+}
+
+static int
+odometry_init(odometry *odom)
+{
+    pthread_condattr_t attr;
+    int err;
+
+    if ((err = pthread_mutex_init(&odom->join_lock, NULL))) {
+        return err;
+    }
+
+    if ((err = pthread_mutex_init(&odom->lock, NULL))) {
+        pthread_mutex_destroy(&odom->join_lock);
+        return err;
+    }
+
+    if ((err = pthread_condattr_init(&attr))) {
+        pthread_mutex_destroy(&odom->lock);
+        pthread_mutex_destroy(&odom->join_lock);
+        return err;
+    }
+
+    /* The thread sleeps until deadlines on the monotonic clock. */
+    if (!(err = pthread_condattr_setclock(&attr, CLOCK_MONOTONIC))) {
+        err = pthread_cond_init(&odom->wake, &attr);
+    }
+    pthread_condattr_destroy(&attr);
+
+    if (err) {
+        pthread_mutex_destroy(&odom->lock);
+        pthread_mutex_destroy(&odom->join_lock);
+    }
+    return err;
+}
+
+static void
+odometry_destroy(odometry *odom)
+{
+    odometry_stop(odom);
+    pthread_cond_destroy(&odom->wake);
+    pthread_mutex_destroy(&odom->lock);
+    pthread_mutex_destroy(&odom->join_lock);
+    PyMem_Free(odom->history);
+}
+
+static PyObject*
+nxt_new(PyTypeObject *cls, PyObject *args, PyObject *kwargs)
+{
+    char *keywords[] = {"mac_address", "timeout", NULL};
+    char *mac_address;
+    PyObject *timeout = Py_None;
+    long long timeout_ns;
+    nxtobject *self;
+    int flags;
+    int err;
+    int n;
+
+    if (!PyArg_ParseTupleAndKeywords(args,
+                                     kwargs,
+                                     "s|O",
+                                     keywords,
+                                     &mac_address,
+                                     &timeout)) {
+        return NULL;
+    }
+
+    if (parse_timeout(timeout, &timeout_ns)) {
+        return NULL;
+    }
+
+    if (!(self = (nxtobject*) cls->tp_alloc(cls, 0))) {
+        return NULL;
+    }
+    /* Mark the object closed until we are connected so that dealloc only
+       tears down what we have set up. */
+    self->closed = 1;
+    self->timeout_ns = timeout_ns;
+    self->battery_level = -1;
+    for (n = 0; n < NUM_INPUT_PORTS; ++n) {
+        calibration_reset(&self->calibrations[n]);
+    }
+
+    if ((err = lane_lock_init(&self->lanes))) {
+        PyObject_Del(self);
+        errno = err;
+        return PyErr_SetFromErrno(PyExc_OSError);
+    }
+
+    if ((err = pthread_mutex_init(&self->conn.write_lock, NULL))) {
+        lane_lock_destroy(&self->lanes);
+        PyObject_Del(self);
+        errno = err;
+        return PyErr_SetFromErrno(PyExc_OSError);
+    }
+
+    if ((err = odometry_init(&self->odom))) {
+        pthread_mutex_destroy(&self->conn.write_lock);
+        lane_lock_destroy(&self->lanes);
+        PyObject_Del(self);
+        errno = err;
+        return PyErr_SetFromErrno(PyExc_OSError);
+    }
+
+    if (NXT_init(&self->nxt) || NXT_connect(&self->nxt, mac_address)) {
+        Py_XDECREF(self);
+        PyErr_Format(PyExc_IOError,
+                     "Failed to connect to a device at MAC: %s",
+                     mac_address);
+        return NULL;
+    }
+    self->closed = 0;
+
+    /* All I/O waits in poll so that it can be bounded by a deadline. */
+    self->conn.sock = self->nxt.sock;
+    if ((flags = fcntl(self->conn.sock, F_GETFL)) < 0 ||
+        fcntl(self->conn.sock, F_SETFL, flags | O_NONBLOCK) < 0) {
+        PyErr_SetFromErrno(PyExc_IOError);
+        Py_DECREF(self);
+        return NULL;
+    }
+
+    return (PyObject*) self;
+}
+
+static void
+nxt_dealloc(nxtobject *self)
+{
+    int n;
+
+    /* Wake the odometry thread like close() does; we hold the GIL, so it
+       must not be left waiting on the NXT. */
+    if (!self->closed) {
+        lane_close(&self->lanes);
+        shutdown(self->conn.sock, SHUT_RDWR);
+    }
+    odometry_destroy(&self->odom);
+    for (n = 0; n < NUM_INPUT_PORTS; ++n) {
+        PyMem_Free(self->calibrations[n].table);
+    }
+    if (!self->closed) {
+        NXT_destroy(&self->nxt);
+    }
+    free(self->conn.pending);
+    pthread_mutex_destroy(&self->conn.write_lock);
+    lane_lock_destroy(&self->lanes);
+    PyObject_Del(self);
+}
+
+static PyObject*
+nxt_repr(nxtobject *self) {
+    return PyUnicode_FromFormat("<%s: %d%s>",
+                                Py_TYPE(self)->tp_name,
+                                self->nxt.dev_id,
+                                (self->closed) ? " (closed)" : "");
+}
+
+PyDoc_STRVAR(nxt_play_tone_doc,
+             "Play a tone of a given frequency for a certain amount of time\n"
+             "on the NXT.\n"
+             "\n"
+             "Parameters\n"
+             "----------\n"
+             "freq : int\n"
+             "    The frequency to play.\n"
+             "time : int\n"
+             "    The amount of time to play the note for in microsenconds.\n"
+             "timeout : float, optional\n"
+             "    The number of seconds to wait for the NXT. Defaults to the\n"
+             "    connection's ``timeout``.\n"
+             "\n"
+             "Raises\n"
+             "------\n"
+             "NXTTimeout\n"
+             "    Raised when the NXT does not respond within the timeout.\n"
+             "IOError\n"
+             "    Raised when communication with the NXT fails.\n");
+
+static PyObject*
+nxt_play_tone(nxtobject *self, PyObject *args, PyObject *kwargs)
+{
+    char *keywords[] = {"freq", "time", "timeout", NULL};
+    unsigned short freq;
+    unsigned short time;
+    PyObject *timeout = NULL;
+    unsigned long long deadline;
+    unsigned char buf[LEN_PREFIX + LEN_PLAYTONE];
+
+    if (!PyArg_ParseTupleAndKeywords(args,
+                                     kwargs,
+                                     "HH|O",
+                                     keywords,
+                                     &freq,
+                                     &time,
+                                     &timeout)) {
+        return NULL;
+    }
+
+    if (call_deadline(self, timeout, &deadline)) {
+        return NULL;
+    }
+
+    if (check_closed(self)) {
+        return NULL;
+    }
+
+    encode_playtone(buf, freq, time);
+    if (send_command(self,
+                     LANE_CONTROL,
+                     TRACE_NO_PORT,
+                     buf,
+                     sizeof(buf),
+                     deadline)) {
+        return raise_io_error("Failed to play a tone");
+    }
+
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(nxt_stay_alive_doc,
+             "Send a message to the NXT that prevents it from turning off.\n"
+             "\n"
+             "If the NXT doesn't see this message for a couple of minutes it\n"
+             "will power down to save battery. The message is dropped when\n"
+             "other commands are using the connection since those keep the\n"
+             "NXT awake as well.\n"
+             "\n"
+             "Parameters\n"
+             "----------\n"
+             "timeout : float, optional\n"
+             "    The number of seconds to wait for the NXT. Defaults to the\n"
+             "    connection's ``timeout``.\n"
+             "\n"
+             "Raises\n"
+             "------\n"
+             "NXTTimeout\n"
+             "    Raised when the NXT does not respond within the timeout.\n"
+             "IOError\n"
+             "    Raised when communication with the NXT fails.\n");
+
+static PyObject*
+nxt_stay_alive(nxtobject *self, PyObject *args, PyObject *kwargs)
+{
+    char *keywords[] = {"timeout", NULL};
+    PyObject *timeout = NULL;
+    unsigned long long deadline;
+    unsigned char buf[LEN_PREFIX + LEN_KEEPALIVE];
+
+    if (!PyArg_ParseTupleAndKeywords(args,
+                                     kwargs,
+                                     "|O",
+                                     keywords,
+                                     &timeout)) {
+        return NULL;
+    }
+
+    if (call_deadline(self, timeout, &deadline)) {
+        return NULL;
+    }
+
+    if (check_closed(self)) {
+        return NULL;
+    }
+
+    encode_simple(buf, DIRECT_COMMAND_NOREPLY, OP_KEEPALIVE);
+    if (send_command(self,
+                     LANE_BACKGROUND,
+                     TRACE_NO_PORT,
+                     buf,
+                     sizeof(buf),
+                     deadline)) {
+        return raise_io_error("Failed to send stay_alve to the NXT");
+    }
+
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(nxt_init_button_doc,
+             "Tell the NXT that there is a button plugged to a certain port.\n"
+             "\n"
+             "Parameters\n"
+             "----------\n"
+             "port : int\n"
+             "    The port which has a button plugged in.\n"
+             "timeout : float, optional\n"
+             "    The number of seconds to wait for the NXT. Defaults to the\n"
+             "    connection's ``timeout``.\n"
+             "\n"
+             "Raises\n"
+             "------\n"
+             "ValueError\n"
+             "    Raised when the port number is out of bounds.\n"
+             "NXTTimeout\n"
+             "    Raised when the NXT does not respond within the timeout.\n"
+             "IOError\n"
+             "    Raised when communication with the NXT fails.\n");
+
+static PyObject*
+nxt_init_button(nxtobject *self, PyObject *args, PyObject *kwargs)
+{
+    char *keywords[] = {"port", "timeout", NULL};
+    int port;
+    PyObject *timeout = NULL;
+    unsigned long long deadline;
+    unsigned char buf[LEN_PREFIX + LEN_SETINPUTMODE];
+
+    if (!PyArg_ParseTupleAndKeywords(args,
+                                     kwargs,
+                                     "i|O",
+                                     keywords,
+                                     &port,
+                                     &timeout)) {
+        return NULL;
+    }
+
+    if (validate_port(port)) {
+        return NULL;
+    }
+
+    if (call_deadline(self, timeout, &deadline)) {
+        return NULL;
+    }
+
+    if (check_closed(self)) {
+        return NULL;
+    }
+
+    encode_setinputmode(buf, port, SENSOR_TYPE_SWITCH, SENSOR_MODE_BOOLEAN);
+    if (send_command(self, LANE_CONTROL, port, buf, sizeof(buf), deadline)) {
+        return raise_io_error("Failed to initalize the button on port %d",
+                              port);
+    }
+
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(nxt_init_light_doc,
+             "Tell the NXT that there is a light sensor plugged to a certain\n"
+             "port.\n"
+             "\n"
+             "Parameters\n"
+             "----------\n"
+             "port : int\n"
+             "    The port which has a light plugged in.\n"
+             "timeout : float, optional\n"
+             "    The number of seconds to wait for the NXT. Defaults to the\n"
+             "    connection's ``timeout``.\n"
+             "\n"
+             "Raises\n"
+             "------\n"
+             "ValueError\n"
+             "    Raised when the port number is out of bounds.\n"
+             "NXTTimeout\n"
+             "    Raised when the NXT does not respond within the timeout.\n"
+             "IOError\n"
+             "    Raised when communication with the NXT fails.\n");
+
+static PyObject*
+nxt_init_light(nxtobject *self, PyObject *args, PyObject *kwargs)
+{
+    char *keywords[] = {"port", "timeout", NULL};
+    int port;
+    PyObject *timeout = NULL;
+    unsigned long long deadline;
+    unsigned char buf[LEN_PREFIX + LEN_SETINPUTMODE];
+
+    if (!PyArg_ParseTupleAndKeywords(args,
+                                     kwargs,
+                                     "i|O",
+                                     keywords,
+                                     &port,
+                                     &timeout)) {
+        return NULL;
+    }
+
+    if (validate_port(port)) {
+        return NULL;
+    }
+
+    if (call_deadline(self, timeout, &deadline)) {
+        return NULL;
+    }
+
+    if (check_closed(self)) {
+        return NULL;
+    }
+
+    encode_setinputmode(buf, port, SENSOR_TYPE_LIGHT_ACTIVE, SENSOR_MODE_RAW);
+    if (send_command(self, LANE_CONTROL, port, buf, sizeof(buf), deadline)) {
+        return raise_io_error("Failed to initalize the light on port %d",
+                              port);
+    }
+
+    Py_RETURN_NONE;
+}
+
+/* Read the GETINPUTVALUES reply for a sensor into ``reply`` which must have
+   room for ``MAX_TELEGRAM`` bytes. */
+static int
+read_input_values(nxtobject *self,
+                  int port,
+                  unsigned char *reply,
+                  unsigned long long deadline)
+{
+    unsigned char request[LEN_PREFIX + LEN_GETINPUTVALUES];
+
+    encode_getinputvalues(request, port);
+    return send_request(self,
+                        LANE_TELEMETRY,
+                        0,
+                        port,
+                        request,
+                        sizeof(request),
+                        reply,
+                        LEN_GETINPUTVALUES_REPLY,
+                        deadline);
+}
+
+PyDoc_STRVAR(nxt_is_pressed_doc,
+             "Check if a button is currently pressed.\n"
+             "\n"
+             "Parameters\n"
+             "----------\n"
+             "port : int\n"
+             "    The port of the button to check.\n"
+             "timeout : float, optional\n"
+             "    The number of seconds to wait for the NXT. Defaults to the\n"
+             "    connection's ``timeout``.\n"
+             "\n"
+             "Returns\n"
+             "-------\n"
+             "is_pressed : bool\n"
+             "    Is the button currently being pressed?\n"
+             "\n"
+             "Raises\n"
+             "------\n"
+             "ValueError\n"
+             "    Raised when the port number is out of bounds.\n"
+             "NXTTimeout\n"
+             "    Raised when the NXT does not respond within the timeout.\n"
+             "IOError\n"
+             "    Raised when communication with the NXT fails.\n");
+
+static PyObject*
+nxt_is_pressed(nxtobject *self, PyObject *args, PyObject *kwargs)
+{
+    char *keywords[] = {"port", "timeout", NULL};
+    int port;
+    PyObject *timeout = NULL;
+    unsigned long long deadline;
+    unsigned char reply[MAX_TELEGRAM];
+
+    if (!PyArg_ParseTupleAndKeywords(args,
+                                     kwargs,
+                                     "i|O",
+                                     keywords,
+                                     &port,
+                                     &timeout)) {
+        return NULL;
+    }
+
+    if (validate_port(port)) {
+        return NULL;
+    }
+
+    if (call_deadline(self, timeout, &deadline)) {
+        return NULL;
+    }
+
+    if (check_closed(self)) {
+        return NULL;
+    }
+
+    if (read_input_values(self, port, reply, deadline)) {
+        return raise_io_error(
+            "Failed to read the state of the button on port %d",
+            port);
+    }
+
+    /* The button is in boolean mode so the scaled value is 0 or 1. */
+    return PyBool_FromLong(read_int16(reply + SCALED_VALUE_OFFSET));
+}
+
+PyDoc_STRVAR(nxt_read_light_doc,
+             "Read the value of a light sensor.\n"
+             "\n"
+             "Parameters\n"
+             "----------\n"
+             "port : int\n"
+             "    The port of the light sensor to read.\n"
+             "timeout : float, optional\n"
+             "    The number of seconds to wait for the NXT. Defaults to the\n"
+             "    connection's ``timeout``.\n"
+             "\n"
+             "Returns\n"
+             "-------\n"
+             "value : int\n"
+             "    The normalized A/D value on a scale from 0 to 1023.\n"
+             "\n"
+             "Raises\n"
+             "------\n"
+             "ValueError\n"
+             "    Raised when the port number is out of bounds.\n"
+             "NXTTimeout\n"
+             "    Raised when the NXT does not respond within the timeout.\n"
+             "IOError\n"
+             "    Raised when communication with the NXT fails.\n");
+
+static PyObject*
+nxt_read_light(nxtobject *self, PyObject *args, PyObject *kwargs)
+{
+    char *keywords[] = {"port", "timeout", NULL};
+    int port;
+    PyObject *timeout = NULL;
+    unsigned long long deadline;
+    unsigned char reply[MAX_TELEGRAM];
+
+    if (!PyArg_ParseTupleAndKeywords(args,
+                                     kwargs,
+                                     "i|O",
+                                     keywords,
+                                     &port,
+                                     &timeout)) {
+        return NULL;
+    }
+
+    if (validate_port(port)) {
+        return NULL;
+    }
+
+    if (call_deadline(self, timeout, &deadline)) {
+        return NULL;
+    }
+
+    if (check_closed(self)) {
+        return NULL;
+    }
+
+    if (read_input_values(self, port, reply, deadline)) {
+        return raise_io_error(
+            "Failed to read the state of the light sensor on port %d",
+            port);
+    }
+
+    return PyLong_FromLong(read_uint16(reply + NORMALIZED_VALUE_OFFSET));
+}
+
+PyDoc_STRVAR(nxt_set_calibration_doc,
+             "Set how the values read from a sensor port are calibrated.\n"
+             "\n"
+             "Calibrated values are computed from the normalized A/D value\n"
+             "of the sensor. The value is mapped from ``[min, max]`` onto\n"
+             "``[0, 1]`` and clamped, then passed through ``table`` if it is\n"
+             "given, and finally smoothed with a low-pass filter if\n"
+             "``smoothing`` is non-zero. Calling this with only a port\n"
+             "resets the port to the defaults.\n"
+             "\n"
+             "Parameters\n"
+             "----------\n"
+             "port : int\n"
+             "    The port to calibrate.\n"
+             "min : float, optional\n"
+             "    The A/D value which maps to 0, for example the reading\n"
+             "    over a dark surface. Defaults to 0.\n"
+             "max : float, optional\n"
+             "    The A/D value which maps to 1. Defaults to 1023.\n"
+             "table : sequence[float], optional\n"
+             "    A lookup table of at least 2 entries evenly spaced over\n"
+             "    ``[0, 1]``. Values between the entries are linearly\n"
+             "    interpolated.\n"
+             "smoothing : float, optional\n"
+             "    The weight of the previous output of the low-pass filter:\n"
+             "    [0, 1). 0 disables the filter.\n"
+             "\n"
+             "Raises\n"
+             "------\n"
+             "ValueError\n"
+             "    Raised when the port number is out of bounds, ``min``,\n"
+             "    ``max``, or any table entry is not finite, ``min`` is not\n"
+             "    less than ``max`` or too close to it, the table is too\n"
+             "    short, or the smoothing is not in the range [0, 1).\n");
+
+static PyObject*
+nxt_set_calibration(nxtobject *self, PyObject *args, PyObject *kwargs)
+{
+    char *keywords[] = {"port", "min", "max", "table", "smoothing", NULL};
+    int port;
+    double min = 0;
+    double max = MAX_SENSOR_VALUE;
+    PyObject *table = Py_None;
+    double smoothing = 0;
+    double scale;
+    PyObject *seq;
+    double *values = NULL;
+    Py_ssize_t len = 0;
+    Py_ssize_t n;
+    calibration *cal;
+
+    if (!PyArg_ParseTupleAndKeywords(args,
+                                     kwargs,
+                                     "i|ddOd",
+                                     keywords,
+                                     &port,
+                                     &min,
+                                     &max,
+                                     &table,
+                                     &smoothing)) {
+        return NULL;
+    }
+
+    if (validate_port(port)) {
+        return NULL;
+    }
+
+    /* Infinite bounds would turn every value into NaN. */
+    if (!isfinite(min) || !isfinite(max)) {
+        PyErr_SetString(PyExc_ValueError, "min and max must be finite");
+        return NULL;
+    }
+
+    if (!(min < max)) {
+        PyErr_SetString(PyExc_ValueError, "min must be less than max");
+        return NULL;
+    }
+
+    /* A range too narrow to invert would turn values at ``min`` into
+       0 * inf, which is NaN. */
+    if (!isfinite(scale = 1.0 / (max - min))) {
+        PyErr_SetString(PyExc_ValueError,
+                        "The range from min to max is too narrow");
+        return NULL;
+    }
+
+    if (!(smoothing >= 0 && smoothing < 1)) {
+        PyErr_SetString(PyExc_ValueError,
+                        "Smoothing must be in the range [0, 1)");
+        return NULL;
+    }
+
+    if (table != Py_None) {
+        if (!(seq = PySequence_Fast(table, "table must be a sequence"))) {
+            return NULL;
+        }
+
+        if ((len = PySequence_Fast_GET_SIZE(seq)) < 2) {
+            Py_DECREF(seq);
+            PyErr_Format(PyExc_ValueError,
+                         "The table needs at least 2 entries, got: %zd",
+                         len);
+            return NULL;
+        }
+
+        if (!(values = PyMem_New(double, len))) {
+            Py_DECREF(seq);
+            return PyErr_NoMemory();
+        }
+
+        for (n = 0; n < len; ++n) {
+            values[n] = PyFloat_AsDouble(PySequence_Fast_GET_ITEM(seq, n));
+            if (values[n] == -1.0 && PyErr_Occurred()) {
+                PyMem_Free(values);
+                Py_DECREF(seq);
+                return NULL;
+            }
+
+            if (!isfinite(values[n])) {
+                PyErr_Format(PyExc_ValueError,
+                             "Table entries must be finite, got: %R",
+                             PySequence_Fast_GET_ITEM(seq, n));
+                PyMem_Free(values);
+                Py_DECREF(seq);
+                return NULL;
+            }
+        }
+        Py_DECREF(seq);
+    }
+
+    cal = &self->calibrations[port - 1];
+    calibration_reset(cal);
+    cal->min = min;
+    cal->scale = scale;
+    cal->table = values;
+    cal->table_size = len;
+    cal->smoothing = smoothing;
+
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(nxt_read_calibrated_doc,
+             "Read the calibrated value of a sensor.\n"
+             "\n"
+             "See ``set_calibration``. When the port has a low-pass filter\n"
+             "each read advances it.\n"
+             "\n"
+             "Parameters\n"
+             "----------\n"
+             "port : int\n"
+             "    The port of the sensor to read.\n"
+             "timeout : float, optional\n"
+             "    The number of seconds to wait for the NXT. Defaults to the\n"
+             "    connection's ``timeout``.\n"
+             "\n"
+             "Returns\n"
+             "-------\n"
+             "value : float\n"
+             "    The calibrated value.\n"
+             "\n"
+             "Raises\n"
+             "------\n"
+             "ValueError\n"
+             "    Raised when the port number is out of bounds.\n"
+             "NXTTimeout\n"
+             "    Raised when the NXT does not respond within the timeout.\n"
+             "IOError\n"
+             "    Raised when communication with the NXT fails.\n");
+
+static PyObject*
+nxt_read_calibrated(nxtobject *self, PyObject *args, PyObject *kwargs)
+{
+    char *keywords[] = {"port", "timeout", NULL};
+    int port;
+    PyObject *timeout = NULL;
+    unsigned long long deadline;
+    unsigned char reply[MAX_TELEGRAM];
+    calibration *cal;
+    uint16_t raw;
+    double value;
+
+    if (!PyArg_ParseTupleAndKeywords(args,
+                                     kwargs,
+                                     "i|O",
+                                     keywords,
+                                     &port,
+                                     &timeout)) {
+        return NULL;
+    }
+
+    if (validate_port(port)) {
+        return NULL;
+    }
+
+    if (call_deadline(self, timeout, &deadline)) {
+        return NULL;
+    }
+
+    if (check_closed(self)) {
+        return NULL;
+    }
+
+    if (read_input_values(self, port, reply, deadline)) {
+        return raise_io_error("Failed to read the sensor on port %d", port);
+    }
+
+    raw = read_uint16(reply + NORMALIZED_VALUE_OFFSET);
+    cal = &self->calibrations[port - 1];
+    calibration_apply(cal, &raw, &value, 1, &cal->filtered, &cal->primed);
+    return PyFloat_FromDouble(value);
+}
+
+/* Create an ``array.array('d')`` of ``len`` zeros. */
+static PyObject*
+new_double_array(Py_ssize_t len)
+{
+    PyObject *module;
+    PyObject *zeros;
+    PyObject *out;
+
+    if (!(module = PyImport_ImportModule("array"))) {
+        return NULL;
+    }
+
+    if (!(zeros = PyBytes_FromStringAndSize(NULL, len * sizeof(double)))) {
+        Py_DECREF(module);
+        return NULL;
+    }
+    memset(PyBytes_AS_STRING(zeros), 0, len * sizeof(double));
+
+    out = PyObject_CallMethod(module, "array", "sO", "d", zeros);
+    Py_DECREF(zeros);
+    Py_DECREF(module);
+    return out;
+}
+
+/* Check that a buffer holds native values of the struct format ``code``. */
+static int
+check_buffer_format(Py_buffer *view, char code, Py_ssize_t itemsize)
+{
+    const char *format = (view->format) ? view->format : "B";
+
+    if (*format == '@' || *format == '=') {
+        ++format;
+    }
+
+    if (format[0] != code || format[1] || view->itemsize != itemsize) {
+        PyErr_Format(PyExc_TypeError,
+                     "Expected a buffer of format '%c', got: '%s'",
+                     code,
+                     (view->format) ? view->format : "B");
+        return -1;
+    }
+    return 0;
+}
+
+PyDoc_STRVAR(nxt_calibrate_doc,
+             "Calibrate a buffer of values captured from a sensor port.\n"
+             "\n"
+             "This applies the same conversion as ``read_calibrated`` to\n"
+             "every sample at once. The low-pass filter starts from the\n"
+             "first sample and does not affect ``read_calibrated``.\n"
+             "\n"
+             "Parameters\n"
+             "----------\n"
+             "port : int\n"
+             "    The port whose calibration to use.\n"
+             "samples : buffer\n"
+             "    The normalized A/D values as unsigned 16 bit integers,\n"
+             "    for example ``array.array('H')``.\n"
+             "out : buffer, optional\n"
+             "    A writable buffer of doubles with the same length as\n"
+             "    ``samples`` to store the results in. A new\n"
+             "    ``array.array('d')`` is used by default.\n"
+             "\n"
+             "Returns\n"
+             "-------\n"
+             "out : buffer\n"
+             "    The calibrated values.\n"
+             "\n"
+             "Raises\n"
+             "------\n"
+             "ValueError\n"
+             "    Raised when the port number is out of bounds or ``out`` is\n"
+             "    not the same length as ``samples``.\n"
+             "TypeError\n"
+             "    Raised when the buffers have the wrong format.\n");
+
+static PyObject*
+nxt_calibrate(nxtobject *self, PyObject *args, PyObject *kwargs)
+{
+    char *keywords[] = {"port", "samples", "out", NULL};
+    int port;
+    PyObject *samples;
+    PyObject *out = Py_None;
+    Py_buffer in_view;
+    Py_buffer out_view;
+    Py_ssize_t len;
+    calibration *cal;
+    double state = 0;
+    unsigned char primed = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args,
+                                     kwargs,
+                                     "iO|O",
+                                     keywords,
+                                     &port,
+                                     &samples,
+                                     &out)) {
+        return NULL;
+    }
+
+    if (validate_port(port)) {
+        return NULL;
+    }
+
+    if (PyObject_GetBuffer(samples,
+                           &in_view,
+                           PyBUF_FORMAT | PyBUF_C_CONTIGUOUS)) {
+        return NULL;
+    }
+
+    if (check_buffer_format(&in_view, 'H', sizeof(uint16_t))) {
+        PyBuffer_Release(&in_view);
+        return NULL;
+    }
+    len = in_view.len / in_view.itemsize;
+
+    if (out == Py_None) {
+        if (!(out = new_double_array(len))) {
+            PyBuffer_Release(&in_view);
+            return NULL;
+        }
+    }
+    else {
+        Py_INCREF(out);
+    }
+
+    if (PyObject_GetBuffer(out,
+                           &out_view,
+                           PyBUF_FORMAT |
+                           PyBUF_C_CONTIGUOUS |
+                           PyBUF_WRITABLE)) {
+        Py_DECREF(out);
+        PyBuffer_Release(&in_view);
+        return NULL;
+    }
+
+    if (check_buffer_format(&out_view, 'd', sizeof(double))) {
+        goto error;
+    }
+
+    if (out_view.len / out_view.itemsize != len) {
+        PyErr_Format(PyExc_ValueError,
+                     "out must have the same length as samples: %zd != %zd",
+                     out_view.len / out_view.itemsize,
+                     len);
+        goto error;
+    }
+
+    cal = &self->calibrations[port - 1];
+    calibration_apply(cal, in_view.buf, out_view.buf, len, &state, &primed);
+
+    PyBuffer_Release(&out_view);
+    PyBuffer_Release(&in_view);
+    return out;
+
+error:
+    PyBuffer_Release(&out_view);
+    Py_DECREF(out);
+    PyBuffer_Release(&in_view);
+    return NULL;
+}
+
+/* Run the left and right motors at the given powers for ``time`` seconds
+   and then stop them. Both motors are started and stopped with a single
+   write so that they move together. The I/O lock is not held while we wait
+   so that other commands and the odometry thread can use the connection.
+   ``timeout_ns`` bounds the start and the stop separately.
+
+   Returns 0 on success or -1 with errno set on failure. */
+static int
+drive_for(nxtobject *self,
+          int time,
+          int left_power,
+          int right_power,
+          int left_port,
+          int right_port,
+          long long timeout_ns)
+{
+    unsigned char buf[2 * (LEN_PREFIX + LEN_SETOUTPUTSTATE)];
+    size_t len;
+
+    len = encode_setoutputstate(buf,
+                                left_port,
+                                left_power,
+                                MODE_MOTORON | MODE_BRAKE,
+                                REGULATION_MODE_IDLE,
+                                0);
+    len += encode_setoutputstate(buf + len,
+                                 right_port,
+                                 right_power,
+                                 MODE_MOTORON | MODE_BRAKE,
+                                 REGULATION_MODE_IDLE,
+                                 0);
+    if (send_command(self,
+                     LANE_CONTROL,
+                     left_port,
+                     buf,
+                     len,
+                     deadline_after(timeout_ns))) {
+        return -1;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    sleep(time);
+    Py_END_ALLOW_THREADS
+
+    len = encode_stopmotor(buf, left_port);
+    len += encode_stopmotor(buf + len, right_port);
+    return send_command(self,
+                        LANE_CONTROL,
+                        left_port,
+                        buf,
+                        len,
+                        deadline_after(timeout_ns));
+}
+
+#define DRIVE_FN(verb, direction, left_sign, right_sign)                \
+    PyDoc_STRVAR(nxt_ ## verb ## _ ## direction ## _doc,                \
+                 "Tell the nxt to " #verb " " #direction " for some\n"  \
+                 "period of time at a specified power.\n"               \
+                 "\n"                                                   \
+                 "Both motors are started in a single write, run for\n" \
+                 "``time`` seconds, and are then braked. Turns spin in\n" \
+                 "place: ``turn_left`` runs the left motor backward and\n" \
+                 "the right motor forward, and ``turn_right`` does the\n" \
+                 "opposite.\n"                                          \
+                 "\n"                                                   \
+                 "Parameters\n"                                         \
+                 "----------\n"                                         \
+                 "time : int\n"                                         \
+                 "    The number of seconds to " #verb " for.\n"        \
+                 "power : int\n"                                        \
+                 "    How much power should be applied to the motors\n" \
+                 "    [-100, 100].\n"                                   \
+                 "left_port : int\n"                                    \
+                 "    The port where the left motor is connected.\n"    \
+                 "right_port : int\n"                                   \
+                 "    The port where the right motor is connected.\n"   \
+                 "timeout : float, optional\n"                          \
+                 "    The number of seconds to wait for the NXT when\n" \
+                 "    starting and when stopping the motors. Defaults\n" \
+                 "    to the connection's ``timeout``.\n"               \
+                 "\n"                                                   \
+                 "Raises\n"                                             \
+                 "------\n"                                             \
+                 "ValueError\n"                                         \
+                 "    Raised when the left or right port is out of bounds\n" \
+                 "    or when the power is not in the range [-100, 100]\n" \
+                 "NXTTimeout\n"                                         \
+                 "    Raised when the NXT does not respond within the\n" \
+                 "    timeout.\n"                                       \
+                 "IOError\n"                                            \
+                 "    Raised when communication with the NXT fails.\n"); \
+                                                                        \
+    static PyObject*                                                    \
+    nxt_ ## verb ## _ ## direction(nxtobject *self,                     \
+                                   PyObject *args,                      \
+                                   PyObject *kwargs)                    \
+    {                                                                   \
+        char *keywords[] = {"time",                                     \
+                            "power",                                    \
+                            "left_port",                                \
+                            "right_port",                               \
+                            "timeout",                                  \
+                            NULL};                                      \
+        int time;                                                       \
+        int power;                                                      \
+        int left_port;                                                  \
+        int right_port;                                                 \
+        PyObject *timeout = NULL;                                       \
+        long long timeout_ns = self->timeout_ns;                        \
+                                                                        \
+        if (!PyArg_ParseTupleAndKeywords(args,                          \
+                                         kwargs,                        \
+                                         "iiii|O",                      \
+                                         keywords,                      \
+                                         &time,                         \
+                                         &power,                        \
+                                         &left_port,                    \
+                                         &right_port,                   \
+                                         &timeout)) {                   \
+            return NULL;                                                \
+        }                                                               \
+                                                                        \
+        if (time < 0) {                                                 \
+            PyErr_Format(PyExc_ValueError,                              \
+                         "Time must be non-negative, got: %d", time);   \
+            return NULL;                                                \
+        }                                                               \
+                                                                        \
+        if (validate_drive_ports(left_port, right_port)) {              \
+            return NULL;                                                \
+        }                                                               \
+                                                                        \
+        if (validate_power(power)) {                                    \
+            return NULL;                                                \
+        }                                                               \
+                                                                        \
+        if (timeout && parse_timeout(timeout, &timeout_ns)) {           \
+            return NULL;                                                \
+        }                                                               \
+                                                                        \
+        if (check_closed(self)) {                                       \
+            return NULL;                                                \
+        }                                                               \
+                                                                        \
+        if (drive_for(self,                                             \
+                      time,                                             \
+                      left_sign power,                                  \
+                      right_sign power,                                 \
+                      left_port,                                        \
+                      right_port,                                       \
+                      timeout_ns)) {                                    \
+            return raise_io_error("Failed to " #verb " " #direction);   \
+        }                                                               \
+                                                                        \
+        Py_RETURN_NONE;                                                 \
+    }
+
+/* The signs applied to ``power`` for the left and right motors. These
+   replace C_NXT's NXT_driveforward family, which started the motors with
+   separate commands; turns spin the robot in place. */
+DRIVE_FN(drive, forward, +, +)
+DRIVE_FN(drive, backward, -, -)
+DRIVE_FN(turn, left, -, +)
+DRIVE_FN(turn, right, +, -)
+
+PyDoc_STRVAR(nxt_set_motor_doc,
+             "Sets the power of a motor.\n"
+             "\n"
+             "Parameters\n"
+             "----------\n"
+             "port : int\n"
+             "    The port of the motor to set the power of: 1-3.\n"
+             "power : int\n"
+             "    The power to set the motor to: [-100, 100].\n"
+             "timeout : float, optional\n"
+             "    The number of seconds to wait for the NXT. Defaults to the\n"
+             "    connection's ``timeout``.\n"
+             "\n"
+             "Raises\n"
+             "------\n"
+             "ValueError\n"
+             "    Raised if the port is not 1-3 or the power is not\n"
+             "    in the range [-100, 100].\n"
+             "NXTTimeout\n"
+             "    Raised when the NXT does not respond within the timeout.\n"
+             "IOError\n"
+             "    Raised when communication with the NXT fails.\n");
+
+static PyObject*
+nxt_set_motor(nxtobject *self, PyObject *args, PyObject *kwargs)
+{
+    char *keywords[] = {"port", "power", "timeout", NULL};
+    int port;
+    int power;
+    PyObject *timeout = NULL;
+    unsigned long long deadline;
+    unsigned char buf[LEN_PREFIX + LEN_SETOUTPUTSTATE];
+
+    if (!PyArg_ParseTupleAndKeywords(args,
+                                     kwargs,
+                                     "ii|O",
+                                     keywords,
+                                     &port,
+                                     &power,
+                                     &timeout)) {
+        return NULL;
+    }
+
+    if (validate_motor_port(port)) {
+        return NULL;
+    }
+
+    if (validate_power(power)) {
+        return NULL;
+    }
+
+    if (call_deadline(self, timeout, &deadline)) {
+        return NULL;
+    }
+
+    if (check_closed(self)) {
+        return NULL;
+    }
+
+    encode_setoutputstate(buf,
+                          port,
+                          power,
+                          MODE_MOTORON | MODE_BRAKE,
+                          REGULATION_MODE_IDLE,
+                          0);
+    if (send_command(self, LANE_CONTROL, port, buf, sizeof(buf), deadline)) {
+        return raise_io_error("Failed to set motor on port %d to %d",
+                              port,
+                              power);
+    }
+
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(nxt_set_motors_doc,
+             "Sets the power of many motors at once.\n"
+             "\n"
+             "The commands for all of the motors are sent back to back in a\n"
+             "single write so that the motors start at the same time.\n"
+             "\n"
+             "Parameters\n"
+             "----------\n"
+             "motors : dict[int, int]\n"
+             "    A mapping from the port of each motor, 1-3, to the power to\n"
+             "    set it to: [-100, 100].\n"
+             "sync : bool, optional\n"
+             "    Use the NXT's motor synchronization to keep the motors\n"
+             "    locked together. This requires exactly two motors.\n"
+             "turn_ratio : int, optional\n"
+             "    When ``sync`` is true, the ratio to turn the synchronized\n"
+             "    motors at: [-100, 100]. 0 drives straight.\n"
+             "timeout : float, optional\n"
+             "    The number of seconds to wait for the NXT. Defaults to the\n"
+             "    connection's ``timeout``.\n"
+             "\n"
+             "Raises\n"
+             "------\n"
+             "ValueError\n"
+             "    Raised if any port is not 1-3 or is given more than once,\n"
+             "    any power is not in the range [-100, 100], ``sync`` is\n"
+             "    passed with other than two motors, or the turn ratio is\n"
+             "    not in the range [-100, 100].\n"
+             "NXTTimeout\n"
+             "    Raised when the NXT does not respond within the timeout.\n"
+             "IOError\n"
+             "    Raised when communication with the NXT fails.\n");
+
+static PyObject*
+nxt_set_motors(nxtobject *self, PyObject *args, PyObject *kwargs)
+{
+    char *keywords[] = {"motors", "sync", "turn_ratio", "timeout", NULL};
+    PyObject *motors;
+    int sync = 0;
+    int turn_ratio = 0;
+    PyObject *timeout = NULL;
+    unsigned long long deadline;
+    unsigned char buf[NUM_OUTPUT_PORTS * (LEN_PREFIX + LEN_SETOUTPUTSTATE)];
+    size_t len = 0;
+    Py_ssize_t pos = 0;
+    PyObject *key;
+    PyObject *value;
+    int port;
+    int power;
+    unsigned int seen = 0;
+    unsigned char mode = MODE_MOTORON | MODE_BRAKE;
+    unsigned char regulation_mode = REGULATION_MODE_IDLE;
+
+    if (!PyArg_ParseTupleAndKeywords(args,
+                                     kwargs,
+                                     "O!|iiO",
+                                     keywords,
+                                     &PyDict_Type,
+                                     &motors,
+                                     &sync,
+                                     &turn_ratio,
+                                     &timeout)) {
+        return NULL;
+    }
+
+    if (PyDict_Size(motors) > NUM_OUTPUT_PORTS) {
+        PyErr_Format(PyExc_ValueError,
+                     "At most %d motors may be set, got: %zd",
+                     NUM_OUTPUT_PORTS,
+                     PyDict_Size(motors));
+        return NULL;
+    }
+
+    if (sync) {
+        if (PyDict_Size(motors) != 2) {
+            PyErr_Format(PyExc_ValueError,
+                         "sync requires exactly 2 motors, got: %zd",
+                         PyDict_Size(motors));
+            return NULL;
+        }
+
+        if (turn_ratio < -100 || turn_ratio > 100) {
+            PyErr_Format(PyExc_ValueError,
+                         "Turn ratio must be in the range [-100, 100], got: %d",
+                         turn_ratio);
+            return NULL;
+        }
+
+        mode |= MODE_REGULATED;
+        regulation_mode = REGULATION_MODE_MOTOR_SYNC;
+    }
+    else {
+        turn_ratio = 0;
+    }
+
+    /* Validate everything before sending anything so that we never start
+       only some of the motors. */
+    while (PyDict_Next(motors, &pos, &key, &value)) {
+        if (!PyArg_Parse(key, "i", &port) || !PyArg_Parse(value, "i", &power)) {
+            return NULL;
+        }
+
+        if (validate_motor_port(port)) {
+            return NULL;
+        }
+
+        /* Distinct keys may still name the same port, for example two
+           objects whose __index__ returns the same number. */
+        if (seen & (1u << port)) {
+            PyErr_Format(PyExc_ValueError,
+                         "Motor port %d was given more than once",
+                         port);
+            return NULL;
+        }
+        seen |= 1u << port;
+
+        if (validate_power(power)) {
+            return NULL;
+        }
+
+        len += encode_setoutputstate(buf + len,
+                                     port,
+                                     power,
+                                     mode,
+                                     regulation_mode,
+                                     turn_ratio);
+    }
+
+    if (call_deadline(self, timeout, &deadline)) {
+        return NULL;
+    }
+
+    if (!len) {
+        Py_RETURN_NONE;
+    }
+
+    if (check_closed(self)) {
+        return NULL;
+    }
+
+    if (send_command(self, LANE_CONTROL, TRACE_NO_PORT, buf, len, deadline)) {
+        return raise_io_error("Failed to set motors");
+    }
+
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(nxt_stop_motor_doc,
+             "Stop a motor.\n"
+             "\n"
+             "Stops are sent ahead of any other queued commands.\n"
+             "\n"
+             "Parameters\n"
+             "----------\n"
+             "port : int\n"
+             "    The port of the motor to stop: 1-3.\n"
+             "timeout : float, optional\n"
+             "    The number of seconds to wait for the NXT. Defaults to the\n"
+             "    connection's ``timeout``.\n"
+             "\n"
+             "Raises\n"
+             "------\n"
+             "ValueError\n"
+             "    Raised if the port is not 1-3\n"
+             "NXTTimeout\n"
+             "    Raised when the NXT does not respond within the timeout.\n"
+             "IOError\n"
+             "    Raised when communication with the NXT fails.\n");
+
+
+static PyObject*
+nxt_stop_motor(nxtobject *self, PyObject *args, PyObject *kwargs)
+{
+    char *keywords[] = {"port", "timeout", NULL};
+    int port;
+    PyObject *timeout = NULL;
+    unsigned long long deadline;
+    unsigned char buf[LEN_PREFIX + LEN_SETOUTPUTSTATE];
+
+    if (!PyArg_ParseTupleAndKeywords(args,
+                                     kwargs,
+                                     "i|O",
+                                     keywords,
+                                     &port,
+                                     &timeout)) {
+        return NULL;
+    }
+
+    if (validate_motor_port(port)) {
+        return NULL;
+    }
+
+    if (call_deadline(self, timeout, &deadline)) {
+        return NULL;
+    }
+
+    if (check_closed(self)) {
+        return NULL;
+    }
+
+    encode_stopmotor(buf, port);
+    if (send_command(self, LANE_EMERGENCY, port, buf, sizeof(buf), deadline)) {
+        return raise_io_error("Failed to stop motor on port %d", port);
+    }
+
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(nxt_stop_all_motors_doc,
+             "Stop all of the motors.\n"
+             "\n"
+             "Stops are sent ahead of any other queued commands.\n"
+             "\n"
+             "Parameters\n"
+             "----------\n"
+             "timeout : float, optional\n"
+             "    The number of seconds to wait for the NXT. Defaults to the\n"
+             "    connection's ``timeout``.\n"
+             "\n"
+             "Raises\n"
+             "------\n"
+             "NXTTimeout\n"
+             "    Raised when the NXT does not respond within the timeout.\n"
+             "IOError\n"
+             "    Raised when communication with the NXT fails.\n");
+
+
+static PyObject*
+nxt_stop_all_motors(nxtobject *self, PyObject *args, PyObject *kwargs)
+{
+    char *keywords[] = {"timeout", NULL};
+    PyObject *timeout = NULL;
+    unsigned long long deadline;
+    unsigned char buf[NUM_OUTPUT_PORTS * (LEN_PREFIX + LEN_SETOUTPUTSTATE)];
+    size_t len = 0;
+    int port;
+
+    if (!PyArg_ParseTupleAndKeywords(args,
+                                     kwargs,
+                                     "|O",
+                                     keywords,
+                                     &timeout)) {
+        return NULL;
+    }
+
+    if (call_deadline(self, timeout, &deadline)) {
+        return NULL;
+    }
+
+    if (check_closed(self)) {
         return NULL;
     }
 
-    self->closed = 0;
-    return (PyObject*) self;
-}
-
-static void
-nxt_dealloc(nxtobject *self)
-{
-    if (!self->closed) {
-        NXT_destroy(&self->nxt);
+    for (port = 1; port <= NUM_OUTPUT_PORTS; ++port) {
+        len += encode_stopmotor(buf + len, port);
+    }
+    if (send_command(self,
+                     LANE_EMERGENCY,
+                     TRACE_NO_PORT,
+                     buf,
+                     len,
+                     deadline)) {
+        return raise_io_error("Failed to stop all motors.");
     }
-    PyObject_Del(self);
-}
 
-static PyObject*
-nxt_repr(nxtobject *self) {
-    return PyUnicode_FromFormat("<%s: %d%s>",
-                                Py_TYPE(self)->tp_name,
-                                self->nxt.dev_id,
-                                (self->closed) ? " (closed)" : "");
+    Py_RETURN_NONE;
 }
 
-PyDoc_STRVAR(nxt_play_tone_doc,
-             "Play a tone of a given frequency for a certain amount of time\n"
-             "on the NXT.\n"
+PyDoc_STRVAR(nxt_get_tacho_count_doc,
+             "Read the tachometer of a motor.\n"
              "\n"
              "Parameters\n"
              "----------\n"
-             "freq : int\n"
-             "    The frequency to play.\n"
-             "time : int\n"
-             "    The amount of time to play the note for in microsenconds.\n"
+             "port : int\n"
+             "    The port of the motor to read.\n"
+             "timeout : float, optional\n"
+             "    The number of seconds to wait for the NXT. Defaults to the\n"
+             "    connection's ``timeout``.\n"
+             "\n"
+             "Returns\n"
+             "-------\n"
+             "count : int\n"
+             "    The position of the motor in degrees.\n"
              "\n"
              "Raises\n"
              "------\n"
+             "ValueError\n"
+             "    Raised if the port is not 1-3\n"
+             "NXTTimeout\n"
+             "    Raised when the NXT does not respond within the timeout.\n"
              "IOError\n"
              "    Raised when communication with the NXT fails.\n");
 
 static PyObject*
-nxt_play_tone(nxtobject *self, PyObject *args, PyObject *kwargs)
+nxt_get_tacho_count(nxtobject *self, PyObject *args, PyObject *kwargs)
 {
-    char *keywords[] = {"freq", "time", NULL};
-    unsigned short freq;
-    unsigned short time;
+    char *keywords[] = {"port", "timeout", NULL};
+    int port;
+    PyObject *timeout = NULL;
+    unsigned long long deadline;
+    unsigned char request[LEN_PREFIX + LEN_GETOUTPUTSTATE];
+    unsigned char reply[MAX_TELEGRAM];
 
     if (!PyArg_ParseTupleAndKeywords(args,
                                      kwargs,
-                                     "HH",
+                                     "i|O",
                                      keywords,
-                                     &freq,
-                                     &time)) {
+                                     &port,
+                                     &timeout)) {
         return NULL;
     }
 
-    if (check_closed(self)) {
+    if (validate_motor_port(port)) {
         return NULL;
     }
 
-    if (NXT_play_tone(&self->nxt, freq, time, 0, NULL)) {
-        PyErr_SetString(PyExc_IOError, "Failed to play a tone");
+    if (call_deadline(self, timeout, &deadline)) {
         return NULL;
     }
 
-    Py_RETURN_NONE;
+    if (check_closed(self)) {
+        return NULL;
+    }
+
+    encode_getoutputstate(request, port);
+    if (send_request(self,
+                     LANE_TELEMETRY,
+                     0,
+                     port,
+                     request,
+                     sizeof(request),
+                     reply,
+                     LEN_GETOUTPUTSTATE_REPLY,
+                     deadline)) {
+        return raise_io_error(
+            "Failed to read the tachometer of the motor on port %d",
+            port);
+    }
+
+    return PyLong_FromLong(read_int32(reply + ROTATION_COUNT_OFFSET));
 }
 
-PyDoc_STRVAR(nxt_stay_alive_doc,
-             "Send a message to the NXT that prevents it from turning off.\n"
+/* Check a MESSAGEREAD reply. On success ``message`` points at the message
+   in ``reply`` with its null terminator stripped, or is NULL when the
+   mailbox was empty.
+
+   Returns 0 on success or -1 with errno set on failure. */
+static int
+check_message_reply(const unsigned char *reply,
+                    size_t len,
+                    const unsigned char **message,
+                    size_t *message_len)
+{
+    size_t size;
+
+    if (len < MESSAGE_OFFSET || reply[0] != REPLY ||
+        reply[1] != OP_MESSAGEREAD) {
+        errno = EPROTO;
+        return -1;
+    }
+
+    if (reply[2] == STATUS_MAILBOX_EMPTY) {
+        *message = NULL;
+        *message_len = 0;
+        return 0;
+    }
+
+    if (check_reply(reply, len, OP_MESSAGEREAD, MESSAGE_OFFSET)) {
+        return -1;
+    }
+
+    size = reply[MESSAGE_SIZE_OFFSET];
+    if (size > len - MESSAGE_OFFSET) {
+        size = len - MESSAGE_OFFSET;
+    }
+    if (size && !reply[MESSAGE_OFFSET + size - 1]) {
+        --size;
+    }
+
+    *message = reply + MESSAGE_OFFSET;
+    *message_len = size;
+    return 0;
+}
+
+static int
+validate_message(Py_buffer *message)
+{
+    if (message->len > MAX_MESSAGE) {
+        PyErr_Format(PyExc_ValueError,
+                     "Messages may be at most %d bytes, got: %zd",
+                     MAX_MESSAGE,
+                     message->len);
+        return -1;
+    }
+    return 0;
+}
+
+PyDoc_STRVAR(nxt_write_message_doc,
+             "Send a message to an inbox of the program running on the NXT.\n"
              "\n"
-             "If the NXT doesn't see this message for a couple of minutes it\n"
-             "will power down to save battery.\n"
+             "Parameters\n"
+             "----------\n"
+             "mailbox : int\n"
+             "    The inbox to write to: 1-10.\n"
+             "message : bytes\n"
+             "    The message to send. This may be at most 58 bytes.\n"
+             "timeout : float, optional\n"
+             "    The number of seconds to wait for the NXT. Defaults to the\n"
+             "    connection's ``timeout``.\n"
              "\n"
              "Raises\n"
              "------\n"
+             "ValueError\n"
+             "    Raised when the mailbox is out of bounds or the message is\n"
+             "    too long.\n"
+             "NXTTimeout\n"
+             "    Raised when the NXT does not respond within the timeout.\n"
              "IOError\n"
              "    Raised when communication with the NXT fails.\n");
 
 static PyObject*
-nxt_stay_alive(nxtobject *self, PyObject *_ __attribute__((unused)))
+nxt_write_message(nxtobject *self, PyObject *args, PyObject *kwargs)
 {
-    if (check_closed(self)) {
+    char *keywords[] = {"mailbox", "message", "timeout", NULL};
+    int mailbox;
+    Py_buffer message;
+    PyObject *timeout = NULL;
+    unsigned long long deadline;
+    unsigned char buf[MAX_MESSAGEWRITE];
+    size_t len;
+
+    if (!PyArg_ParseTupleAndKeywords(args,
+                                     kwargs,
+                                     "is*|O",
+                                     keywords,
+                                     &mailbox,
+                                     &message,
+                                     &timeout)) {
         return NULL;
     }
 
-    if (NXT_stay_alive(&self->nxt)) {
-        PyErr_SetString(PyExc_IOError, "Failed to send stay_alve to the NXT");
+    if (validate_mailbox(mailbox) ||
+        validate_message(&message) ||
+        call_deadline(self, timeout, &deadline) ||
+        check_closed(self)) {
+        PyBuffer_Release(&message);
         return NULL;
     }
 
+    len = encode_messagewrite(buf, mailbox, message.buf, message.len);
+    PyBuffer_Release(&message);
+
+    if (send_command(self, LANE_CONTROL, TRACE_NO_PORT, buf, len, deadline)) {
+        return raise_io_error("Failed to write to mailbox %d", mailbox);
+    }
+
     Py_RETURN_NONE;
 }
 
-PyDoc_STRVAR(nxt_init_button_doc,
-             "Tell the NXT that there is a button plugged to a certain port.\n"
+PyDoc_STRVAR(nxt_write_messages_doc,
+             "Send many messages to the program running on the NXT at once.\n"
+             "\n"
+             "All of the messages are packed into a single write so that a\n"
+             "batch of parameters costs one trip over the link instead of\n"
+             "one per message. The messages are delivered in order.\n"
              "\n"
              "Parameters\n"
              "----------\n"
-             "port : int\n"
-             "    The port which has a button plugged in.\n"
+             "messages : iterable[tuple[int, bytes]]\n"
+             "    The ``(mailbox, message)`` pairs to send. See\n"
+             "    ``write_message``.\n"
+             "timeout : float, optional\n"
+             "    The number of seconds to wait for the NXT. Defaults to the\n"
+             "    connection's ``timeout``.\n"
              "\n"
              "Raises\n"
              "------\n"
              "ValueError\n"
-             "    Raised when the port number is out of bounds.\n"
+             "    Raised when any mailbox is out of bounds or any message is\n"
+             "    too long. No messages are sent.\n"
+             "NXTTimeout\n"
+             "    Raised when the NXT does not respond within the timeout.\n"
              "IOError\n"
              "    Raised when communication with the NXT fails.\n");
 
 static PyObject*
-nxt_init_button(nxtobject *self, PyObject *args, PyObject *kwargs)
+nxt_write_messages(nxtobject *self, PyObject *args, PyObject *kwargs)
 {
-    char *keywords[] = {"port", NULL};
-    int port;
+    char *keywords[] = {"messages", "timeout", NULL};
+    PyObject *messages;
+    PyObject *timeout = NULL;
+    unsigned long long deadline;
+    PyObject *iter;
+    PyObject *item;
+    int mailbox;
+    Py_buffer message;
+    unsigned char *buf = NULL;
+    unsigned char *tmp;
+    size_t len = 0;
+    size_t cap = 0;
+    int status;
 
     if (!PyArg_ParseTupleAndKeywords(args,
                                      kwargs,
-                                     "i",
+                                     "O|O",
                                      keywords,
-                                     &port)) {
+                                     &messages,
+                                     &timeout)) {
         return NULL;
     }
 
-    if (port < 1 || port > 4) {
-        PyErr_Format(PyExc_ValueError, "Port must be 1-4, got: %d", port);
+    if (call_deadline(self, timeout, &deadline)) {
         return NULL;
     }
 
-    if (check_closed(self)) {
+    if (!(iter = PyObject_GetIter(messages))) {
         return NULL;
     }
 
-    /* Port is 0 indexed, 0 corrosponds to "Port 1" on the physical device. */
-    if (NXT_initbutton(&self->nxt, (sensor_port) port - 1)) {
-        PyErr_Format(PyExc_IOError,
-                     "Failed to initalize the button on port %d",
-                     port);
+    /* Encode everything before sending anything so that a bad message does
+       not leave the batch half delivered. */
+    while ((item = PyIter_Next(iter))) {
+        if (!PyArg_ParseTuple(item, "is*", &mailbox, &message)) {
+            Py_DECREF(item);
+            goto error;
+        }
+        Py_DECREF(item);
+
+        if (validate_mailbox(mailbox) || validate_message(&message)) {
+            PyBuffer_Release(&message);
+            goto error;
+        }
+
+        if (cap - len < MAX_MESSAGEWRITE) {
+            cap = (cap) ? cap * 2 : 16 * MAX_MESSAGEWRITE;
+            if (!(tmp = PyMem_Realloc(buf, cap))) {
+                PyBuffer_Release(&message);
+                PyErr_NoMemory();
+                goto error;
+            }
+            buf = tmp;
+        }
+
+        len += encode_messagewrite(buf + len,
+                                   mailbox,
+                                   message.buf,
+                                   message.len);
+        PyBuffer_Release(&message);
+    }
+    Py_DECREF(iter);
+
+    if (PyErr_Occurred()) {
+        PyMem_Free(buf);
         return NULL;
     }
 
+    if (!len) {
+        Py_RETURN_NONE;
+    }
+
+    if (check_closed(self)) {
+        PyMem_Free(buf);
+        return NULL;
+    }
+
+    status = send_command(self,
+                          LANE_CONTROL,
+                          TRACE_NO_PORT,
+                          buf,
+                          len,
+                          deadline);
+    PyMem_Free(buf);
+    if (status) {
+        return raise_io_error("Failed to write messages");
+    }
+
     Py_RETURN_NONE;
+
+error:
+    Py_DECREF(iter);
+    PyMem_Free(buf);
+    return NULL;
 }
 
-PyDoc_STRVAR(nxt_init_light_doc,
-             "Tell the NXT that there is a light sensor plugged to a certain\n"
-             "port.\n"
+PyDoc_STRVAR(nxt_read_message_doc,
+             "Read a message from an outbox of the program running on the\n"
+             "NXT.\n"
+             "\n"
+             "This does not wait for a message to be sent; if the outbox is\n"
+             "empty it returns None right away.\n"
              "\n"
              "Parameters\n"
              "----------\n"
-             "port : int\n"
-             "    The port which has a light plugged in.\n"
+             "mailbox : int\n"
+             "    The outbox to read from: 1-10.\n"
+             "remove : bool, optional\n"
+             "    Remove the message from the outbox. Defaults to True.\n"
+             "timeout : float, optional\n"
+             "    The number of seconds to wait for the NXT. Defaults to the\n"
+             "    connection's ``timeout``.\n"
+             "\n"
+             "Returns\n"
+             "-------\n"
+             "message : bytes or None\n"
+             "    The oldest message in the outbox, or None if it is empty.\n"
              "\n"
              "Raises\n"
              "------\n"
              "ValueError\n"
-             "    Raised when the port number is out of bounds.\n"
+             "    Raised when the mailbox is out of bounds.\n"
+             "NXTTimeout\n"
+             "    Raised when the NXT does not respond within the timeout.\n"
              "IOError\n"
              "    Raised when communication with the NXT fails.\n");
 
 static PyObject*
-nxt_init_light(nxtobject *self, PyObject *args, PyObject *kwargs)
+nxt_read_message(nxtobject *self, PyObject *args, PyObject *kwargs)
 {
-    char *keywords[] = {"port", NULL};
-    int port;
+    char *keywords[] = {"mailbox", "remove", "timeout", NULL};
+    int mailbox;
+    int remove = 1;
+    PyObject *timeout = NULL;
+    unsigned long long deadline;
+    unsigned char request[LEN_PREFIX + LEN_MESSAGEREAD];
+    unsigned char reply[MAX_TELEGRAM];
+    const unsigned char *message;
+    size_t message_len;
+    size_t len;
+    nxt_trace trace;
 
     if (!PyArg_ParseTupleAndKeywords(args,
                                      kwargs,
-                                     "i",
+                                     "i|iO",
                                      keywords,
-                                     &port)) {
+                                     &mailbox,
+                                     &remove,
+                                     &timeout)) {
         return NULL;
     }
 
-    if (validate_port(port)) {
+    if (validate_mailbox(mailbox)) {
         return NULL;
     }
 
-    if (check_closed(self)) {
+    if (call_deadline(self, timeout, &deadline)) {
         return NULL;
     }
 
-    /* Port is 0 indexed, 0 corrosponds to "Port 1" on the physical device. */
-    if (NXT_initlight(&self->nxt, (sensor_port) port - 1)) {
-        PyErr_Format(PyExc_IOError,
-                     "Failed to initalize the light on port %d",
-                     port);
+    if (check_closed(self)) {
         return NULL;
     }
 
-    Py_RETURN_NONE;
+    encode_messageread(request, mailbox, remove);
+    trace_begin(&trace, OP_MESSAGEREAD, TRACE_NO_PORT, sizeof(request));
+    if (trace_end(&trace,
+                  send_requests(self,
+                                LANE_TELEMETRY,
+                                0,
+                                request,
+                                sizeof(request),
+                                1,
+                                reply,
+                                &len,
+                                deadline) ||
+                  check_message_reply(reply, len, &message, &message_len))) {
+        return raise_io_error("Failed to read from mailbox %d", mailbox);
+    }
+
+    if (!message) {
+        Py_RETURN_NONE;
+    }
+
+    return PyBytes_FromStringAndSize((const char*) message, message_len);
 }
 
-PyDoc_STRVAR(nxt_is_pressed_doc,
-             "Check if a button is currently pressed.\n"
+PyDoc_STRVAR(nxt_poll_messages_doc,
+             "Take the next message from every outbox of the program running\n"
+             "on the NXT.\n"
+             "\n"
+             "The reads for all of the outboxes are sent in a single write\n"
+             "and the replies are collected together. This does not wait for\n"
+             "messages to be sent.\n"
              "\n"
              "Parameters\n"
              "----------\n"
-             "port : int\n"
-             "    The port of the button to check.\n"
+             "timeout : float, optional\n"
+             "    The number of seconds to wait for the NXT. Defaults to the\n"
+             "    connection's ``timeout``.\n"
              "\n"
              "Returns\n"
              "-------\n"
-             "is_pressed : bool\n"
-             "    Is the button currently being pressed?\n"
+             "messages : dict[int, bytes]\n"
+             "    The message taken from each outbox which was not empty.\n"
              "\n"
              "Raises\n"
              "------\n"
-             "ValueError\n"
-             "    Raised when the port number is out of bounds.\n"
+             "NXTTimeout\n"
+             "    Raised when the NXT does not respond within the timeout.\n"
              "IOError\n"
              "    Raised when communication with the NXT fails.\n");
 
 static PyObject*
-nxt_is_pressed(nxtobject *self, PyObject *args, PyObject *kwargs)
+nxt_poll_messages(nxtobject *self, PyObject *args, PyObject *kwargs)
 {
-    char *keywords[] = {"port", NULL};
-    int port;
-    int result;
+    char *keywords[] = {"timeout", NULL};
+    PyObject *timeout = NULL;
+    unsigned long long deadline;
+    unsigned char requests[NUM_MAILBOXES * (LEN_PREFIX + LEN_MESSAGEREAD)];
+    unsigned char replies[NUM_MAILBOXES * MAX_TELEGRAM];
+    size_t lens[NUM_MAILBOXES];
+    const unsigned char *message;
+    size_t message_len;
+    size_t len = 0;
+    nxt_trace trace;
+    PyObject *out;
+    PyObject *key;
+    PyObject *value;
+    int mailbox;
 
     if (!PyArg_ParseTupleAndKeywords(args,
                                      kwargs,
-                                     "i",
+                                     "|O",
                                      keywords,
-                                     &port)) {
+                                     &timeout)) {
         return NULL;
     }
 
-    if (validate_port(port)) {
+    if (call_deadline(self, timeout, &deadline)) {
         return NULL;
     }
 
@@ -306,52 +3684,480 @@ nxt_is_pressed(nxtobject *self, PyObject *args, PyObject *kwargs)
         return NULL;
     }
 
-    if ((result = NXT_ispressed(&self->nxt, (sensor_port) port - 1)) < 0) {
-        PyErr_Format(PyExc_IOError,
-                     "Failed to read the state of the button on port %d",
-                     port);
+    for (mailbox = 1; mailbox <= NUM_MAILBOXES; ++mailbox) {
+        len += encode_messageread(requests + len, mailbox, 1);
+    }
+
+    trace_begin(&trace, OP_MESSAGEREAD, TRACE_NO_PORT, len);
+    if (trace_end(&trace,
+                  send_requests(self,
+                                LANE_TELEMETRY,
+                                0,
+                                requests,
+                                len,
+                                NUM_MAILBOXES,
+                                replies,
+                                lens,
+                                deadline))) {
+        return raise_io_error("Failed to poll the mailboxes");
+    }
+
+    if (!(out = PyDict_New())) {
         return NULL;
     }
 
-    return PyBool_FromLong(result);
+    for (mailbox = 1; mailbox <= NUM_MAILBOXES; ++mailbox) {
+        if (check_message_reply(replies + (mailbox - 1) * MAX_TELEGRAM,
+                                lens[mailbox - 1],
+                                &message,
+                                &message_len)) {
+            Py_DECREF(out);
+            return raise_io_error("Failed to read from mailbox %d", mailbox);
+        }
+
+        if (!message) {
+            continue;
+        }
+
+        if (!(key = PyLong_FromLong(mailbox))) {
+            Py_DECREF(out);
+            return NULL;
+        }
+        if (!(value = PyBytes_FromStringAndSize((const char*) message,
+                                                message_len))) {
+            Py_DECREF(key);
+            Py_DECREF(out);
+            return NULL;
+        }
+        if (PyDict_SetItem(out, key, value)) {
+            Py_DECREF(value);
+            Py_DECREF(key);
+            Py_DECREF(out);
+            return NULL;
+        }
+        Py_DECREF(value);
+        Py_DECREF(key);
+    }
+
+    return out;
 }
 
-PyDoc_STRVAR(nxt_read_light_doc,
-             "Read the value of a light sensor.\n"
+static int
+validate_filename(const char *name)
+{
+    size_t len = strlen(name);
+
+    if (!len || len > MAX_FILENAME) {
+        PyErr_Format(PyExc_ValueError,
+                     "File names must be 1-%d bytes, got: '%s'",
+                     MAX_FILENAME,
+                     name);
+        return -1;
+    }
+    return 0;
+}
+
+/* The bytes to upload. Paths, which may be str or os.PathLike, are mapped
+   into memory so that large files are paged in as they are sent rather than
+   copied up front; anything else is read through the buffer protocol. */
+typedef struct {
+    const unsigned char *data;
+    size_t len;
+    void *map;
+    Py_buffer view;
+    unsigned char have_view;
+} upload_source;
+
+/* Is ``source`` the path of a file rather than its contents? On Python 3
+   bytes are always contents. */
+static int
+upload_source_is_path(PyObject *source)
+{
+#if COMPILING_IN_PY2
+    return PyString_Check(source) || PyUnicode_Check(source);
+#else
+    return (PyUnicode_Check(source) ||
+            (!PyBytes_Check(source) &&
+             PyObject_HasAttrString(source, "__fspath__")));
+#endif  /* COMPILING_IN_PY2 */
+}
+
+/* Open the file at the path ``source`` for reading. Returns the descriptor
+   or -1 with an exception set. */
+static int
+upload_source_open_path(PyObject *source)
+{
+    int fd;
+#if COMPILING_IN_PY2
+    char *path = NULL;
+
+    if (!PyArg_Parse(source, "et", Py_FileSystemDefaultEncoding, &path)) {
+        return -1;
+    }
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    PyMem_Free(path);
+#else
+    PyObject *path;
+
+    /* This goes through PyOS_FSPath so os.PathLike objects work too. */
+    if (!PyUnicode_FSConverter(source, &path)) {
+        return -1;
+    }
+    fd = open(PyBytes_AS_STRING(path), O_RDONLY | O_CLOEXEC);
+    Py_DECREF(path);
+#endif  /* COMPILING_IN_PY2 */
+
+    if (fd < 0) {
+        PyErr_SetFromErrnoWithFilenameObject(PyExc_IOError, source);
+    }
+    return fd;
+}
+
+static int
+upload_source_open(PyObject *source, upload_source *src)
+{
+    struct stat st;
+    int fd;
+
+    memset(src, 0, sizeof(*src));
+
+    if (!upload_source_is_path(source)) {
+        if (PyObject_GetBuffer(source, &src->view, PyBUF_SIMPLE)) {
+            return -1;
+        }
+        src->have_view = 1;
+        src->data = src->view.buf;
+        src->len = src->view.len;
+        return 0;
+    }
+
+    if ((fd = upload_source_open_path(source)) < 0) {
+        return -1;
+    }
+
+    if (fstat(fd, &st)) {
+        PyErr_SetFromErrnoWithFilenameObject(PyExc_IOError, source);
+        close(fd);
+        return -1;
+    }
+
+    /* mmap cannot map an empty file. */
+    if (st.st_size) {
+        src->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (src->map == MAP_FAILED) {
+            src->map = NULL;
+            PyErr_SetFromErrnoWithFilenameObject(PyExc_IOError, source);
+            close(fd);
+            return -1;
+        }
+        madvise(src->map, st.st_size, MADV_SEQUENTIAL);
+        src->data = src->map;
+        src->len = st.st_size;
+    }
+    close(fd);
+    return 0;
+}
+
+static void
+upload_source_release(upload_source *src)
+{
+    if (src->map) {
+        munmap(src->map, src->len);
+    }
+    if (src->have_view) {
+        PyBuffer_Release(&src->view);
+    }
+}
+
+/* Call ``progress(done, total, bytes_per_second)`` unless it is None. */
+static int
+report_progress(PyObject *progress,
+                size_t done,
+                size_t total,
+                unsigned long long start)
+{
+    PyObject *result;
+    double elapsed;
+    double rate;
+
+    if (progress == Py_None) {
+        return 0;
+    }
+
+    elapsed = (monotonic_ns() - start) / 1e9;
+    rate = (elapsed > 0) ? done / elapsed : 0.0;
+    if (!(result = PyObject_CallFunction(progress,
+                                         "nnd",
+                                         (Py_ssize_t) done,
+                                         (Py_ssize_t) total,
+                                         rate))) {
+        return -1;
+    }
+    Py_DECREF(result);
+    return 0;
+}
+
+/* Open a file on the NXT with OPENREAD, OPENWRITE, or OPENWRITELINEAR and
+   store its handle, and for OPENREAD its size. */
+static int
+open_file(nxtobject *self,
+          const unsigned char *request,
+          size_t request_len,
+          unsigned char *handle,
+          uint32_t *size,
+          unsigned long long deadline)
+{
+    unsigned char reply[MAX_TELEGRAM];
+    unsigned char opcode = request[LEN_PREFIX + 1];
+
+    if (send_request(self,
+                     LANE_BACKGROUND,
+                     0,
+                     TRACE_NO_PORT,
+                     request,
+                     request_len,
+                     reply,
+                     (opcode == OP_OPENREAD) ?
+                     LEN_OPENREAD_REPLY :
+                     LEN_OPENWRITE_REPLY,
+                     deadline)) {
+        return -1;
+    }
+
+    *handle = reply[HANDLE_OFFSET];
+    if (size) {
+        *size = (uint32_t) read_int32(reply + FILE_SIZE_OFFSET);
+    }
+    return 0;
+}
+
+/* Close a file on the NXT after a failed transfer. errno is preserved so
+   that the original failure is reported. */
+static void
+abandon_file(nxtobject *self, unsigned char handle, long long timeout_ns)
+{
+    unsigned char request[LEN_PREFIX + LEN_CLOSE];
+    unsigned char reply[MAX_TELEGRAM];
+    int err = errno;
+
+    encode_close(request, handle);
+    send_request(self,
+                 LANE_BACKGROUND,
+                 0,
+                 TRACE_NO_PORT,
+                 request,
+                 sizeof(request),
+                 reply,
+                 LEN_CLOSE_REPLY,
+                 deadline_after(timeout_ns));
+    errno = err;
+}
+
+/* Send up to ``TRANSFER_DEPTH`` WRITE telegrams back to back and then check
+   all of their replies. The number of bytes written is stored in
+   ``written``. */
+static int
+write_chunks(nxtobject *self,
+             unsigned char handle,
+             const unsigned char *data,
+             size_t len,
+             size_t *written,
+             unsigned long long deadline)
+{
+    unsigned char requests[TRANSFER_DEPTH * (LEN_PREFIX + MAX_TELEGRAM)];
+    unsigned char replies[TRANSFER_DEPTH * MAX_TELEGRAM];
+    size_t lens[TRANSFER_DEPTH];
+    size_t chunks[TRANSFER_DEPTH];
+    size_t requests_len = 0;
+    size_t n = 0;
+    size_t i;
+    nxt_trace trace;
+    int status;
+
+    *written = 0;
+    while (n < TRANSFER_DEPTH && *written < len) {
+        chunks[n] = len - *written;
+        if (chunks[n] > MAX_WRITE_CHUNK) {
+            chunks[n] = MAX_WRITE_CHUNK;
+        }
+        requests_len += encode_write(requests + requests_len,
+                                     handle,
+                                     data + *written,
+                                     chunks[n]);
+        *written += chunks[n++];
+    }
+
+    trace_begin(&trace, OP_WRITE, TRACE_NO_PORT, requests_len);
+    status = send_requests(self,
+                           LANE_BACKGROUND,
+                           0,
+                           requests,
+                           requests_len,
+                           n,
+                           replies,
+                           lens,
+                           deadline);
+    for (i = 0; !status && i < n; ++i) {
+        if (!(status = check_reply(replies + i * MAX_TELEGRAM,
+                                   lens[i],
+                                   OP_WRITE,
+                                   LEN_WRITE_REPLY)) &&
+            read_uint16(replies + i * MAX_TELEGRAM + TRANSFER_COUNT_OFFSET) !=
+            chunks[i]) {
+            errno = EIO;
+            status = -1;
+        }
+    }
+    return trace_end(&trace, status);
+}
+
+/* Send up to ``TRANSFER_DEPTH`` READ telegrams back to back and copy the
+   data from their replies into ``out``. The number of bytes read is stored
+   in ``nread``. */
+static int
+read_chunks(nxtobject *self,
+            unsigned char handle,
+            unsigned char *out,
+            size_t len,
+            size_t *nread,
+            unsigned long long deadline)
+{
+    unsigned char requests[TRANSFER_DEPTH * (LEN_PREFIX + LEN_READ)];
+    unsigned char replies[TRANSFER_DEPTH * MAX_TELEGRAM];
+    size_t lens[TRANSFER_DEPTH];
+    size_t chunks[TRANSFER_DEPTH];
+    size_t requests_len = 0;
+    size_t requested = 0;
+    size_t n = 0;
+    size_t i;
+    const unsigned char *reply;
+    nxt_trace trace;
+    int status;
+
+    while (n < TRANSFER_DEPTH && requested < len) {
+        chunks[n] = len - requested;
+        if (chunks[n] > MAX_READ_CHUNK) {
+            chunks[n] = MAX_READ_CHUNK;
+        }
+        requests_len += encode_read(requests + requests_len,
+                                    handle,
+                                    chunks[n]);
+        requested += chunks[n++];
+    }
+
+    *nread = 0;
+    trace_begin(&trace, OP_READ, TRACE_NO_PORT, requests_len);
+    status = send_requests(self,
+                           LANE_BACKGROUND,
+                           0,
+                           requests,
+                           requests_len,
+                           n,
+                           replies,
+                           lens,
+                           deadline);
+    for (i = 0; !status && i < n; ++i) {
+        reply = replies + i * MAX_TELEGRAM;
+        if (!(status = check_reply(reply,
+                                   lens[i],
+                                   OP_READ,
+                                   LEN_READ_REPLY_HEADER + chunks[i])) &&
+            read_uint16(reply + TRANSFER_COUNT_OFFSET) != chunks[i]) {
+            errno = EIO;
+            status = -1;
+        }
+        if (!status) {
+            memcpy(out + *nread, reply + LEN_READ_REPLY_HEADER, chunks[i]);
+            *nread += chunks[i];
+        }
+    }
+    return trace_end(&trace, status);
+}
+
+PyDoc_STRVAR(nxt_upload_doc,
+             "Write a file to the NXT.\n"
+             "\n"
+             "The file is sent in the largest packets the NXT accepts, and\n"
+             "many packets are sent before waiting for the NXT to\n"
+             "acknowledge them.\n"
              "\n"
              "Parameters\n"
              "----------\n"
-             "port : int\n"
-             "    The port of the light sensor to read.\n"
+             "source : path-like or bytes-like\n"
+             "    The path of the file to upload as a str or\n"
+             "    ``os.PathLike``, which is read through mmap, or the\n"
+             "    contents of the file as bytes or any other bytes-like\n"
+             "    object.\n"
+             "name : str\n"
+             "    The name of the file on the NXT, for example\n"
+             "    ``'program.rxe'``. This may be at most 19 bytes. Files\n"
+             "    the firmware runs in place (``.rxe``, ``.ric``,\n"
+             "    ``.rtm``, and ``.sys``) are stored contiguously in flash.\n"
+             "progress : callable, optional\n"
+             "    Called as ``progress(done, total, bytes_per_second)`` as\n"
+             "    the upload proceeds.\n"
+             "overwrite : bool, optional\n"
+             "    Delete any existing file with the same name first.\n"
+             "timeout : float, optional\n"
+             "    The number of seconds to wait for each exchange with the\n"
+             "    NXT. Defaults to the connection's ``timeout``.\n"
              "\n"
              "Returns\n"
              "-------\n"
-             "value : int\n"
-             "    The value on a scale from 0 to 1024.\n"
+             "size : int\n"
+             "    The number of bytes written.\n"
              "\n"
              "Raises\n"
              "------\n"
              "ValueError\n"
-             "    Raised when the port number is out of bounds.\n"
+             "    Raised when the name is too long or the file is larger\n"
+             "    than 4GiB.\n"
+             "NXTTimeout\n"
+             "    Raised when the NXT does not respond within the timeout.\n"
              "IOError\n"
-             "    Raised when communication with the NXT fails.\n");
+             "    Raised when the source cannot be read or communication\n"
+             "    with the NXT fails.\n");
 
 static PyObject*
-nxt_read_light(nxtobject *self, PyObject *args, PyObject *kwargs)
+nxt_upload(nxtobject *self, PyObject *args, PyObject *kwargs)
 {
-    char *keywords[] = {"port", NULL};
-    int port;
-    int result;
+    char *keywords[] = {"source",
+                        "name",
+                        "progress",
+                        "overwrite",
+                        "timeout",
+                        NULL};
+    PyObject *source;
+    const char *name;
+    PyObject *progress = Py_None;
+    int overwrite = 0;
+    PyObject *timeout = NULL;
+    long long timeout_ns = self->timeout_ns;
+    upload_source src;
+    unsigned char request[LEN_PREFIX + LEN_OPENWRITE];
+    unsigned char reply[MAX_TELEGRAM];
+    unsigned char handle;
+    unsigned long long start;
+    size_t done = 0;
+    size_t written;
 
     if (!PyArg_ParseTupleAndKeywords(args,
                                      kwargs,
-                                     "i",
+                                     "Os|OiO",
                                      keywords,
-                                     &port)) {
+                                     &source,
+                                     &name,
+                                     &progress,
+                                     &overwrite,
+                                     &timeout)) {
         return NULL;
     }
 
-    if (validate_port(port)) {
+    if (validate_filename(name)) {
+        return NULL;
+    }
+
+    if (timeout && parse_timeout(timeout, &timeout_ns)) {
         return NULL;
     }
 
@@ -359,142 +4165,152 @@ nxt_read_light(nxtobject *self, PyObject *args, PyObject *kwargs)
         return NULL;
     }
 
-    if ((result = NXT_ispressed(&self->nxt, (sensor_port) port - 1)) < 0) {
-        PyErr_Format(PyExc_IOError,
-                     "Failed to read the state of the light sensor on port %d",
-                     port);
+    if (upload_source_open(source, &src)) {
         return NULL;
     }
 
-    return PyLong_FromLong(result);
-}
+    if (src.len > UINT32_MAX) {
+        PyErr_Format(PyExc_ValueError,
+                     "Files may be at most 4GiB, got: %zu bytes",
+                     src.len);
+        goto error;
+    }
 
-#define DRIVE_FN(verb, direction)                                       \
-    PyDoc_STRVAR(nxt_ ## verb ## _ ## direction ## _doc,                \
-                 "Tell the nxt to " #verb " " #direction " for some\n"  \
-                 "period of time at a specified power.\n"               \
-                 "\n"                                                   \
-                 "Parameters\n"                                         \
-                 "----------\n"                                         \
-                 "time : int\n"                                         \
-                 "    The number of seconds to " #verb " for.\n"        \
-                 "power : int\n"                                        \
-                 "    How much power should be applied to the motors\n" \
-                 "    [-100, 100].\n"                                   \
-                 "left_port : int\n"                                    \
-                 "    The port where the left motor is connected.\n"    \
-                 "right_port : int\n"                                   \
-                 "    The port where the right motor is connected.\n"   \
-                 "\n"                                                   \
-                 "Raises\n"                                             \
-                 "------\n"                                             \
-                 "ValueError\n"                                         \
-                 "    Raised when the left or right port is out of bounds\n" \
-                 "    or when the power is not in the range [-100, 100]\n" \
-                 "IOError\n"                                            \
-                 "    Raised when communication with the NXT fails.\n"); \
-                                                                        \
-    static PyObject*                                                    \
-    nxt_ ## verb ## _ ## direction(nxtobject *self,                     \
-                                   PyObject *args,                      \
-                                   PyObject *kwargs)                    \
-    {                                                                   \
-        char *keywords[] = {"time",                                     \
-                            "power",                                    \
-                            "left_port",                                \
-                            "right_port",                               \
-                            NULL};                                      \
-        int time;                                                       \
-        int power;                                                      \
-        int left_port;                                                  \
-        int right_port;                                                 \
-                                                                        \
-        if (!PyArg_ParseTupleAndKeywords(args,                          \
-                                         kwargs,                        \
-                                         "iiii",                        \
-                                         keywords,                      \
-                                         &time,                         \
-                                         &power,                        \
-                                         &left_port,                    \
-                                         &right_port)) {                \
-            return NULL;                                                \
-        }                                                               \
-                                                                        \
-        if (left_port < 1 || right_port > 4) {                          \
-            PyErr_Format(PyExc_ValueError,                              \
-                         "Left port must be 1-4, got: %d", left_port);  \
-        }                                                               \
-                                                                        \
-        if (right_port < 1 || right_port > 4) {                         \
-            PyErr_Format(PyExc_ValueError,                              \
-                         "Right port must be 1-4, got: %d", right_port); \
-        }                                                               \
-                                                                        \
-        if (validate_power(power)) {                                    \
-            return NULL;                                                \
-        }                                                               \
-                                                                        \
-        if (check_closed(self)) {                                       \
-            return NULL;                                                \
-        }                                                               \
-                                                                        \
-        if (NXT_ ## verb ## direction(&self->nxt,                       \
-                                           time,                        \
-                                           power,                       \
-                                           (motor_port) left_port - 1,  \
-                                           (motor_port) right_port - 1)) { \
-            PyErr_SetString(PyExc_IOError,                              \
-                            "Failed to " #verb " " #direction);         \
-            return NULL;                                                \
-        }                                                               \
-                                                                        \
-        Py_RETURN_NONE;                                                 \
+    start = monotonic_ns();
+
+    if (overwrite) {
+        encode_filename_command(request, OP_DELETE, name);
+        if (send_request(self,
+                         LANE_BACKGROUND,
+                         0,
+                         TRACE_NO_PORT,
+                         request,
+                         LEN_PREFIX + LEN_DELETE,
+                         reply,
+                         LEN_DELETE_REPLY,
+                         deadline_after(timeout_ns)) &&
+            !(errno == EIO && reply[2] == STATUS_FILE_NOT_FOUND)) {
+            raise_io_error("Failed to delete %s from the NXT", name);
+            goto error;
+        }
     }
 
-DRIVE_FN(drive, forward)
-DRIVE_FN(drive, backward)
-DRIVE_FN(turn, left)
-DRIVE_FN(turn, right)
+    encode_openwrite(request, name, (uint32_t) src.len);
+    if (open_file(self,
+                  request,
+                  sizeof(request),
+                  &handle,
+                  NULL,
+                  deadline_after(timeout_ns))) {
+        raise_io_error("Failed to open %s for writing on the NXT", name);
+        goto error;
+    }
 
-PyDoc_STRVAR(nxt_set_motor_doc,
-             "Sets the power of a motor.\n"
+    while (done < src.len) {
+        if (write_chunks(self,
+                         handle,
+                         src.data + done,
+                         src.len - done,
+                         &written,
+                         deadline_after(timeout_ns))) {
+            abandon_file(self, handle, timeout_ns);
+            raise_io_error("Failed to write %s to the NXT", name);
+            goto error;
+        }
+        done += written;
+
+        if (report_progress(progress, done, src.len, start)) {
+            abandon_file(self, handle, timeout_ns);
+            goto error;
+        }
+    }
+
+    encode_close(request, handle);
+    if (send_request(self,
+                     LANE_BACKGROUND,
+                     0,
+                     TRACE_NO_PORT,
+                     request,
+                     LEN_PREFIX + LEN_CLOSE,
+                     reply,
+                     LEN_CLOSE_REPLY,
+                     deadline_after(timeout_ns))) {
+        raise_io_error("Failed to close %s on the NXT", name);
+        goto error;
+    }
+
+    upload_source_release(&src);
+    return PyLong_FromSize_t(done);
+
+error:
+    upload_source_release(&src);
+    return NULL;
+}
+
+PyDoc_STRVAR(nxt_download_doc,
+             "Read a file from the NXT.\n"
+             "\n"
+             "The file is read in the largest packets the NXT sends, and\n"
+             "many reads are sent before waiting for the NXT to answer them.\n"
              "\n"
              "Parameters\n"
              "----------\n"
-             "port : int\n"
-             "    The port of the motor to set the power of.\n"
-             "power : int\n"
-             "    The power to set the motor to: [-100, 100].\n"
+             "name : str\n"
+             "    The name of the file on the NXT.\n"
+             "progress : callable, optional\n"
+             "    Called as ``progress(done, total, bytes_per_second)`` as\n"
+             "    the download proceeds.\n"
+             "timeout : float, optional\n"
+             "    The number of seconds to wait for each exchange with the\n"
+             "    NXT. Defaults to the connection's ``timeout``.\n"
+             "\n"
+             "Returns\n"
+             "-------\n"
+             "contents : bytes\n"
+             "    The contents of the file.\n"
              "\n"
              "Raises\n"
              "------\n"
              "ValueError\n"
-             "    Raised if the port is out of bounds or the power is not\n"
-             "    in the range [-100, 100].\n"
+             "    Raised when the name is too long.\n"
+             "NXTTimeout\n"
+             "    Raised when the NXT does not respond within the timeout.\n"
              "IOError\n"
-             "    Raised when communication with the NXT fails.\n");
+             "    Raised when the file does not exist or communication with\n"
+             "    the NXT fails.\n");
 
 static PyObject*
-nxt_set_motor(nxtobject *self, PyObject *args, PyObject *kwargs)
+nxt_download(nxtobject *self, PyObject *args, PyObject *kwargs)
 {
-    char *keywords[] = {"port", "power", NULL};
-    int port;
-    int power;
+    char *keywords[] = {"name", "progress", "timeout", NULL};
+    const char *name;
+    PyObject *progress = Py_None;
+    PyObject *timeout = NULL;
+    long long timeout_ns = self->timeout_ns;
+    unsigned char request[LEN_PREFIX + LEN_OPENREAD];
+    unsigned char reply[MAX_TELEGRAM];
+    unsigned char handle;
+    uint32_t size;
+    unsigned long long start;
+    PyObject *out;
+    size_t done = 0;
+    size_t nread;
 
     if (!PyArg_ParseTupleAndKeywords(args,
                                      kwargs,
-                                     "ii",
+                                     "s|OO",
                                      keywords,
-                                     &port,
-                                     &power)) {
+                                     &name,
+                                     &progress,
+                                     &timeout)) {
         return NULL;
     }
 
-    if (validate_port(port)) {
+    if (validate_filename(name)) {
         return NULL;
     }
 
-    if (validate_power(power)) {
+    if (timeout && parse_timeout(timeout, &timeout_ns)) {
         return NULL;
     }
 
@@ -502,91 +4318,321 @@ nxt_set_motor(nxtobject *self, PyObject *args, PyObject *kwargs)
         return NULL;
     }
 
-    if (NXT_setmotor(&self->nxt, (motor_port) port - 1, power)) {
-        PyErr_Format(PyExc_IOError,
-                     "Failed to set motor on port %d to %d",
-                     port,
-                     power);
+    start = monotonic_ns();
+
+    encode_filename_command(request, OP_OPENREAD, name);
+    if (open_file(self,
+                  request,
+                  sizeof(request),
+                  &handle,
+                  &size,
+                  deadline_after(timeout_ns))) {
+        return raise_io_error("Failed to open %s for reading on the NXT",
+                              name);
+    }
+
+    if (!(out = PyBytes_FromStringAndSize(NULL, size))) {
+        abandon_file(self, handle, timeout_ns);
         return NULL;
     }
 
-    Py_RETURN_NONE;
+    while (done < size) {
+        /* Nothing else can see ``out`` yet so it is safe to fill it without
+           the GIL. */
+        if (read_chunks(self,
+                        handle,
+                        (unsigned char*) PyBytes_AS_STRING(out) + done,
+                        size - done,
+                        &nread,
+                        deadline_after(timeout_ns))) {
+            abandon_file(self, handle, timeout_ns);
+            Py_DECREF(out);
+            return raise_io_error("Failed to read %s from the NXT", name);
+        }
+        done += nread;
+
+        if (report_progress(progress, done, size, start)) {
+            abandon_file(self, handle, timeout_ns);
+            Py_DECREF(out);
+            return NULL;
+        }
+    }
+
+    encode_close(request, handle);
+    if (send_request(self,
+                     LANE_BACKGROUND,
+                     0,
+                     TRACE_NO_PORT,
+                     request,
+                     LEN_PREFIX + LEN_CLOSE,
+                     reply,
+                     LEN_CLOSE_REPLY,
+                     deadline_after(timeout_ns))) {
+        Py_DECREF(out);
+        return raise_io_error("Failed to close %s on the NXT", name);
+    }
+
+    return out;
 }
 
-PyDoc_STRVAR(nxt_stop_motor_doc,
-             "Stop a motor.\n"
+PyDoc_STRVAR(nxt_start_odometry_doc,
+             "Start tracking the pose of a differential drive robot.\n"
+             "\n"
+             "A background thread polls the tachometers of the drive motors\n"
+             "at ``rate`` Hz and integrates the robot's position and heading\n"
+             "without calling back into Python. The pose starts at\n"
+             "``(0, 0, 0)``.\n"
              "\n"
              "Parameters\n"
              "----------\n"
-             "port : int\n"
-             "    The port of the motor to stop.\n"
+             "left_port : int\n"
+             "    The port where the left motor is connected.\n"
+             "right_port : int\n"
+             "    The port where the right motor is connected.\n"
+             "wheel_radius : float\n"
+             "    The radius of the wheels. ``x`` and ``y`` are reported in\n"
+             "    the same units.\n"
+             "track_width : float\n"
+             "    The distance between the two wheels.\n"
+             "rate : float, optional\n"
+             "    The number of samples to take per second.\n"
+             "history : int, optional\n"
+             "    The number of samples to keep in ``pose_history``.\n"
+             "timeout : float, optional\n"
+             "    The number of seconds to wait for each sample. Samples that\n"
+             "    time out are skipped and counted in ``timeouts``. Defaults\n"
+             "    to the connection's ``timeout``. When that is None each\n"
+             "    sample waits at most 1 second so that stopping is never\n"
+             "    held up by a stalled link.\n"
              "\n"
              "Raises\n"
              "------\n"
              "ValueError\n"
-             "    Raised if the port is out of bounds\n"
-             "IOError\n"
-             "    Raised when communication with the NXT fails.\n");
-
+             "    Raised when the left or right port is out of bounds, or\n"
+             "    when any of the other parameters are not positive and\n"
+             "    finite.\n"
+             "RuntimeError\n"
+             "    Raised when odometry is already running.\n");
 
 static PyObject*
-nxt_stop_motor(nxtobject *self, PyObject *args, PyObject *kwargs)
+nxt_start_odometry(nxtobject *self, PyObject *args, PyObject *kwargs)
 {
-    char *keywords[] = {"port", NULL};
-    int port;
+    char *keywords[] = {"left_port",
+                        "right_port",
+                        "wheel_radius",
+                        "track_width",
+                        "rate",
+                        "history",
+                        "timeout",
+                        NULL};
+    int left_port;
+    int right_port;
+    double wheel_radius;
+    double track_width;
+    double rate = 20.0;
+    Py_ssize_t history = 1024;
+    PyObject *timeout = NULL;
+    long long timeout_ns = self->timeout_ns;
+    odometry *odom = &self->odom;
+    pose_sample *buf;
+    unsigned char exited;
+    int err;
 
     if (!PyArg_ParseTupleAndKeywords(args,
                                      kwargs,
-                                     "i",
+                                     "iidd|dnO",
                                      keywords,
-                                     &port)) {
+                                     &left_port,
+                                     &right_port,
+                                     &wheel_radius,
+                                     &track_width,
+                                     &rate,
+                                     &history,
+                                     &timeout)) {
         return NULL;
     }
 
-    if (validate_port(port)) {
+    if (validate_drive_ports(left_port, right_port)) {
         return NULL;
     }
 
-    if (check_closed(self)) {
+    if (!(wheel_radius > 0 && track_width > 0 && rate > 0 && history > 0)) {
+        PyErr_SetString(PyExc_ValueError,
+                        "wheel_radius, track_width, rate, and history must"
+                        " all be positive");
         return NULL;
     }
 
-    if (NXT_stopmotor(&self->nxt, (motor_port) port - 1)) {
-        PyErr_Format(PyExc_IOError,
-                     "Failed to stop motor on port %d",
-                     port);
+    if (!isfinite(wheel_radius) || !isfinite(track_width) || !isfinite(rate)) {
+        PyErr_SetString(PyExc_ValueError,
+                        "wheel_radius, track_width, and rate must all be"
+                        " finite");
+        return NULL;
+    }
+
+    if (timeout && parse_timeout(timeout, &timeout_ns)) {
+        return NULL;
+    }
+
+    if (check_closed(self)) {
         return NULL;
     }
 
+    if (!(buf = PyMem_New(pose_sample, history))) {
+        return PyErr_NoMemory();
+    }
+
+    pthread_mutex_lock(&odom->join_lock);
+    if (odom->running) {
+        /* A thread which stopped on its own after a communication failure
+           only needs to be joined before it can be restarted. */
+        pthread_mutex_lock(&odom->lock);
+        exited = odom->exited;
+        pthread_mutex_unlock(&odom->lock);
+
+        if (!exited) {
+            pthread_mutex_unlock(&odom->join_lock);
+            PyMem_Free(buf);
+            PyErr_SetString(PyExc_RuntimeError, "Odometry is already running");
+            return NULL;
+        }
+        odometry_join(odom);
+    }
+    PyMem_Free(odom->history);
+
+    odom->left_port = left_port;
+    odom->right_port = right_port;
+    odom->distance_per_degree = wheel_radius * Py_MATH_PI / 180;
+    odom->track_width = track_width;
+    /* Clamp before converting, which is undefined for periods that do not
+       fit. */
+    odom->period_ns = (1e9 / rate >= (double) LLONG_MAX)
+        ? LLONG_MAX
+        : (unsigned long long) (1e9 / rate);
+    odom->timeout_ns = (timeout_ns < 0) ? ODOMETRY_TIMEOUT_NS : timeout_ns;
+    odom->stop = 0;
+    odom->exited = 0;
+    odom->have_counts = 0;
+    odom->error = 0;
+    odom->pose.t = monotonic_ns() / 1e9;
+    odom->pose.x = 0;
+    odom->pose.y = 0;
+    odom->pose.heading = 0;
+    odom->history = buf;
+    odom->history_size = history;
+    odom->history_len = 0;
+    odom->history_head = 0;
+
+    if ((err = pthread_create(&odom->thread, NULL, odometry_thread, self))) {
+        pthread_mutex_unlock(&odom->join_lock);
+        errno = err;
+        return PyErr_SetFromErrno(PyExc_OSError);
+    }
+    odom->running = 1;
+    pthread_mutex_unlock(&odom->join_lock);
+
     Py_RETURN_NONE;
 }
 
-PyDoc_STRVAR(nxt_stop_all_motors_doc,
-             "Stop all of the motors.\n"
+PyDoc_STRVAR(nxt_stop_odometry_doc,
+             "Stop tracking the pose of the robot.\n"
+             "\n"
+             "The last pose and the pose history remain available.\n");
+
+static PyObject*
+nxt_stop_odometry(nxtobject *self, PyObject *_ __attribute__((unused)))
+{
+    Py_BEGIN_ALLOW_THREADS
+    odometry_stop(&self->odom);
+    Py_END_ALLOW_THREADS
+
+    Py_RETURN_NONE;
+}
+
+/* Raise an IOError if the odometry thread stopped because of a
+   communication failure. The caller must hold ``odom->lock``. */
+static int
+check_odometry_error(odometry *odom)
+{
+    if (odom->error) {
+        errno = odom->error;
+        PyErr_SetFromErrno(PyExc_IOError);
+        return -1;
+    }
+    return 0;
+}
+
+PyDoc_STRVAR(nxt_pose_history_doc,
+             "The most recent poses computed by the odometry thread.\n"
+             "\n"
+             "Returns\n"
+             "-------\n"
+             "history : list[tuple[float, float, float, float]]\n"
+             "    ``(t, x, y, heading)`` for each sample, oldest first. ``t``\n"
+             "    is in seconds on the same clock as ``time.monotonic``.\n"
              "\n"
              "Raises\n"
              "------\n"
              "IOError\n"
-             "    Raised when communication with the NXT fails.\n");
-
+             "    Raised when the odometry thread stopped because\n"
+             "    communication with the NXT failed.\n");
 
 static PyObject*
-nxt_stop_all_motors(nxtobject *self, PyObject *_ __attribute__((unused)))
+nxt_pose_history(nxtobject *self, PyObject *_ __attribute__((unused)))
 {
-    if (check_closed(self)) {
+    odometry *odom = &self->odom;
+    pose_sample *samples;
+    size_t len;
+    size_t start;
+    size_t n;
+    PyObject *out;
+    PyObject *item;
+
+    /* Copy the samples out under the lock and build the Python objects
+       afterwards so that the odometry thread is never kept waiting on the
+       allocator. */
+    pthread_mutex_lock(&odom->lock);
+    if (check_odometry_error(odom)) {
+        pthread_mutex_unlock(&odom->lock);
         return NULL;
     }
+    len = odom->history_len;
+    if (!(samples = PyMem_New(pose_sample, len ? len : 1))) {
+        pthread_mutex_unlock(&odom->lock);
+        return PyErr_NoMemory();
+    }
+    start = (odom->history_head + odom->history_size - len) %
+        ((odom->history_size) ? odom->history_size : 1);
+    for (n = 0; n < len; ++n) {
+        samples[n] = odom->history[(start + n) % odom->history_size];
+    }
+    pthread_mutex_unlock(&odom->lock);
 
-    if (NXT_stopallmotors(&self->nxt)) {
-        PyErr_SetString(PyExc_IOError, "Failed to stop all motors.");
+    if (!(out = PyList_New(len))) {
+        PyMem_Free(samples);
         return NULL;
     }
-
-    Py_RETURN_NONE;
+    for (n = 0; n < len; ++n) {
+        if (!(item = Py_BuildValue("(dddd)",
+                                   samples[n].t,
+                                   samples[n].x,
+                                   samples[n].y,
+                                   samples[n].heading))) {
+            Py_DECREF(out);
+            PyMem_Free(samples);
+            return NULL;
+        }
+        PyList_SET_ITEM(out, n, item);
+    }
+    PyMem_Free(samples);
+    return out;
 }
 
 PyDoc_STRVAR(nxt_close_doc,
-             "Close the connection to the Lego NXT.\n");
+             "Close the connection to the Lego NXT.\n"
+             "\n"
+             "Calls still in progress on other threads fail with an\n"
+             "``IOError`` instead of waiting for the NXT.\n");
 
 static PyObject*
 nxt_close(nxtobject *self, PyObject *_ __attribute__((unused)))
@@ -595,8 +4641,21 @@ nxt_close(nxtobject *self, PyObject *_ __attribute__((unused)))
         Py_RETURN_NONE;
     }
 
-    NXT_destroy(&self->nxt);
+    /* New calls fail from here on. Calls already in flight are woken by
+       shutting the socket down and fail as closed once they let go of the
+       link, so that the socket is not destroyed under them. */
     self->closed = 1;
+
+    Py_BEGIN_ALLOW_THREADS
+    lane_close(&self->lanes);
+    shutdown(self->conn.sock, SHUT_RDWR);
+    odometry_stop(&self->odom);
+    lane_wait_idle(&self->lanes);
+    pthread_mutex_lock(&self->conn.write_lock);
+    NXT_destroy(&self->nxt);
+    pthread_mutex_unlock(&self->conn.write_lock);
+    Py_END_ALLOW_THREADS
+
     Py_RETURN_NONE;
 }
 
@@ -611,23 +4670,62 @@ nxt_enter(nxtobject *self, PyObject *_ __attribute__((unused)))
 }
 
 PyDoc_STRVAR(nxt_get_battery_level_doc,
-             "The charge remaining in mV.\n");
+             "The charge remaining in mV.\n"
+             "\n"
+             "Once the level has been read, reading it while the link is\n"
+             "busy returns the last level instead of waiting.\n");
 
 static PyObject*
 nxt_get_battery_level(nxtobject *self, void *_ __attribute__((unused)))
 {
-    int battery_level;
+    unsigned char request[LEN_PREFIX + LEN_GETBATTERYLEVEL];
+    unsigned char reply[MAX_TELEGRAM];
+    int status;
 
     if (check_closed(self)) {
         return NULL;
     }
 
-    if ((battery_level = NXT_battery_level(&self->nxt))) {
-        PyErr_SetString(PyExc_IOError, "Failed to read the battery level");
+    /* The level changes slowly, so it is shed like a keepalive once there is
+       a reading to fall back on. */
+    encode_simple(request, DIRECT_COMMAND, OP_GETBATTERYLEVEL);
+    if ((status = send_request(self,
+                               LANE_BACKGROUND,
+                               self->battery_level >= 0,
+                               TRACE_NO_PORT,
+                               request,
+                               sizeof(request),
+                               reply,
+                               LEN_GETBATTERYLEVEL_REPLY,
+                               deadline_after(self->timeout_ns))) < 0) {
+        return raise_io_error("Failed to read the battery level");
+    }
+
+    if (!status) {
+        self->battery_level = read_uint16(reply + BATTERY_LEVEL_OFFSET);
+    }
+    return PyLong_FromLong(self->battery_level);
+}
+
+PyDoc_STRVAR(nxt_pose_doc,
+             "The current ``(x, y, heading)`` of the robot computed by the\n"
+             "odometry thread.\n");
+
+static PyObject*
+nxt_get_pose(nxtobject *self, void *_ __attribute__((unused)))
+{
+    odometry *odom = &self->odom;
+    pose_sample pose;
+
+    pthread_mutex_lock(&odom->lock);
+    if (check_odometry_error(odom)) {
+        pthread_mutex_unlock(&odom->lock);
         return NULL;
     }
+    pose = odom->pose;
+    pthread_mutex_unlock(&odom->lock);
 
-    return PyLong_FromLong(battery_level);
+    return Py_BuildValue("(ddd)", pose.x, pose.y, pose.heading);
 }
 
 PyDoc_STRVAR(nxt_dev_id_doc,
@@ -643,6 +4741,87 @@ nxt_get_dev_id(nxtobject *self, void *_ __attribute__((unused)))
     return PyLong_FromLong(self->nxt.dev_id);
 }
 
+PyDoc_STRVAR(nxt_queue_stats_doc,
+             "How long commands have waited for the link in each priority\n"
+             "lane.\n"
+             "\n"
+             "A dict from each of ``'emergency'``, ``'control'``,\n"
+             "``'telemetry'``, and ``'background'`` to a dict with the\n"
+             "``count`` of commands sent, the ``mean_delay`` and\n"
+             "``max_delay`` in seconds spent queued, and the number of\n"
+             "commands ``shed`` because the link was busy.\n");
+
+static PyObject*
+nxt_get_queue_stats(nxtobject *self, void *_ __attribute__((unused)))
+{
+    lane_stats stats[NUM_LANES];
+    PyObject *out;
+    PyObject *item;
+    int lane;
+
+    pthread_mutex_lock(&self->lanes.lock);
+    memcpy(stats, self->lanes.stats, sizeof(stats));
+    pthread_mutex_unlock(&self->lanes.lock);
+
+    if (!(out = PyDict_New())) {
+        return NULL;
+    }
+
+    for (lane = 0; lane < NUM_LANES; ++lane) {
+        if (!(item = Py_BuildValue(
+                  "{sKsdsdsK}",
+                  "count",
+                  stats[lane].count,
+                  "mean_delay",
+                  (stats[lane].count) ?
+                  stats[lane].total_delay_ns / 1e9 / stats[lane].count :
+                  0.0,
+                  "max_delay",
+                  stats[lane].max_delay_ns / 1e9,
+                  "shed",
+                  stats[lane].shed))) {
+            Py_DECREF(out);
+            return NULL;
+        }
+
+        if (PyDict_SetItemString(out, lane_names[lane], item)) {
+            Py_DECREF(item);
+            Py_DECREF(out);
+            return NULL;
+        }
+        Py_DECREF(item);
+    }
+
+    return out;
+}
+
+PyDoc_STRVAR(nxt_timeout_doc,
+             "The default number of seconds to wait for the NXT in each\n"
+             "call, or None to wait forever.\n");
+
+static PyObject*
+nxt_get_timeout(nxtobject *self, void *_ __attribute__((unused)))
+{
+    if (self->timeout_ns < 0) {
+        Py_RETURN_NONE;
+    }
+
+    return PyFloat_FromDouble(self->timeout_ns / 1e9);
+}
+
+static int
+nxt_set_timeout(nxtobject *self,
+                PyObject *value,
+                void *_ __attribute__((unused)))
+{
+    if (!value) {
+        PyErr_SetString(PyExc_AttributeError, "Cannot delete the timeout");
+        return -1;
+    }
+
+    return parse_timeout(value, &self->timeout_ns);
+}
+
 static PyGetSetDef nxt_getsets[] = {
   {"battery_level",
    (getter) nxt_get_battery_level,
@@ -654,14 +4833,46 @@ static PyGetSetDef nxt_getsets[] = {
    NULL,
    nxt_dev_id_doc,
    NULL},
+  {"pose",
+   (getter) nxt_get_pose,
+   NULL,
+   nxt_pose_doc,
+   NULL},
+  {"queue_stats",
+   (getter) nxt_get_queue_stats,
+   NULL,
+   nxt_queue_stats_doc,
+   NULL},
+  {"timeout",
+   (getter) nxt_get_timeout,
+   (setter) nxt_set_timeout,
+   nxt_timeout_doc,
+   NULL},
   {NULL},
 };
 
 PyDoc_STRVAR(nxt_closed_doc,
              "Is the connection to the Lego NXT closed?\n");
 
+PyDoc_STRVAR(nxt_timeouts_doc,
+             "The number of calls to the NXT that have timed out.\n");
+
+PyDoc_STRVAR(nxt_late_replies_doc,
+             "The number of replies that arrived after their call timed out\n"
+             "and were discarded.\n");
+
 static PyMemberDef nxt_members[] = {
     {"closed", T_INT, offsetof(nxtobject, closed), READONLY, nxt_closed_doc},
+    {"timeouts",
+     T_ULONG,
+     offsetof(nxtobject, conn.timeouts),
+     READONLY,
+     nxt_timeouts_doc},
+    {"late_replies",
+     T_ULONG,
+     offsetof(nxtobject, conn.late_replies),
+     READONLY,
+     nxt_late_replies_doc},
     {NULL},
 };
 
@@ -672,7 +4883,7 @@ static PyMethodDef nxt_methods[] = {
      nxt_play_tone_doc},
     {"stay_alive",
      (PyCFunction) nxt_stay_alive,
-     METH_NOARGS,
+     METH_VARARGS | METH_KEYWORDS,
      nxt_stay_alive_doc},
     {"init_button",
      (PyCFunction) nxt_init_button,
@@ -690,6 +4901,18 @@ static PyMethodDef nxt_methods[] = {
      (PyCFunction) nxt_read_light,
      METH_VARARGS | METH_KEYWORDS,
      nxt_read_light_doc},
+    {"set_calibration",
+     (PyCFunction) nxt_set_calibration,
+     METH_VARARGS | METH_KEYWORDS,
+     nxt_set_calibration_doc},
+    {"read_calibrated",
+     (PyCFunction) nxt_read_calibrated,
+     METH_VARARGS | METH_KEYWORDS,
+     nxt_read_calibrated_doc},
+    {"calibrate",
+     (PyCFunction) nxt_calibrate,
+     METH_VARARGS | METH_KEYWORDS,
+     nxt_calibrate_doc},
     {"drive_forward",
      (PyCFunction) nxt_drive_forward,
      METH_VARARGS | METH_KEYWORDS,
@@ -710,14 +4933,58 @@ static PyMethodDef nxt_methods[] = {
      (PyCFunction) nxt_set_motor,
      METH_VARARGS | METH_KEYWORDS,
      nxt_set_motor_doc},
+    {"set_motors",
+     (PyCFunction) nxt_set_motors,
+     METH_VARARGS | METH_KEYWORDS,
+     nxt_set_motors_doc},
     {"stop_motor",
      (PyCFunction) nxt_stop_motor,
      METH_VARARGS | METH_KEYWORDS,
      nxt_stop_motor_doc},
     {"stop_all_motors",
      (PyCFunction) nxt_stop_all_motors,
-     METH_NOARGS,
+     METH_VARARGS | METH_KEYWORDS,
      nxt_stop_all_motors_doc},
+    {"get_tacho_count",
+     (PyCFunction) nxt_get_tacho_count,
+     METH_VARARGS | METH_KEYWORDS,
+     nxt_get_tacho_count_doc},
+    {"write_message",
+     (PyCFunction) nxt_write_message,
+     METH_VARARGS | METH_KEYWORDS,
+     nxt_write_message_doc},
+    {"write_messages",
+     (PyCFunction) nxt_write_messages,
+     METH_VARARGS | METH_KEYWORDS,
+     nxt_write_messages_doc},
+    {"read_message",
+     (PyCFunction) nxt_read_message,
+     METH_VARARGS | METH_KEYWORDS,
+     nxt_read_message_doc},
+    {"poll_messages",
+     (PyCFunction) nxt_poll_messages,
+     METH_VARARGS | METH_KEYWORDS,
+     nxt_poll_messages_doc},
+    {"upload",
+     (PyCFunction) nxt_upload,
+     METH_VARARGS | METH_KEYWORDS,
+     nxt_upload_doc},
+    {"download",
+     (PyCFunction) nxt_download,
+     METH_VARARGS | METH_KEYWORDS,
+     nxt_download_doc},
+    {"start_odometry",
+     (PyCFunction) nxt_start_odometry,
+     METH_VARARGS | METH_KEYWORDS,
+     nxt_start_odometry_doc},
+    {"stop_odometry",
+     (PyCFunction) nxt_stop_odometry,
+     METH_NOARGS,
+     nxt_stop_odometry_doc},
+    {"pose_history",
+     (PyCFunction) nxt_pose_history,
+     METH_NOARGS,
+     nxt_pose_history_doc},
     {"close",
      (PyCFunction) nxt_close,
      METH_NOARGS,
@@ -739,7 +5006,10 @@ PyDoc_STRVAR(nxt_doc,
              "Parameters\n"
              "----------\n"
              "mac_address : str\n"
-             "    The mac address of the nxt robot.\n");
+             "    The mac address of the nxt robot.\n"
+             "timeout : float, optional\n"
+             "    The default number of seconds to wait for the NXT in each\n"
+             "    call. By default calls wait forever.\n");
 
 static PyTypeObject nxt_type = {
     PyVarObject_HEAD_INIT(&PyType_Type, 0)
@@ -824,6 +5094,21 @@ init_nxt(void)
         return ERROR_RETURN;
     }
 
+    if (!(NXTTimeout = PyErr_NewException("pynxt.NXTTimeout",
+                                          PyExc_IOError,
+                                          NULL))) {
+        Py_DECREF(m);
+        return ERROR_RETURN;
+    }
+
+    if (PyModule_AddObject(m, "NXTTimeout", NXTTimeout)) {
+        Py_DECREF(NXTTimeout);
+        Py_DECREF(m);
+        return ERROR_RETURN;
+    }
+    /* The module owns the reference we passed in; keep one for raising. */
+    Py_INCREF(NXTTimeout);
+
 #if !COMPILING_IN_PY2
     return m;
 #endif  /* !COMPILING_IN_PY2 */
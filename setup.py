@@ -32,7 +32,7 @@ setup(
             'pynxt._nxt',
             ['pynxt/_nxt.c'] + glob.glob('C_NXT/src/*.c'),
             include_dirs=['C_NXT/include'],
-            libraries=['bluetooth'],
+            libraries=['bluetooth', 'm', 'pthread'],
         ),
     ],
 )